@@ -1,16 +1,24 @@
 #include <iostream>
-#include <fstream>
 #include <string>
 #include <vector>
 #include <queue>
 #include <map>
+#include <array>
 #include <chrono>
 #include <cmath>
 #include <cstring>
 #include <cerrno>
+#include <fstream>
 #include <sstream>
+#include <iomanip>
 #include <numeric>
 #include <unordered_set> // Include for the hash set
+#include <unordered_map>
+#include <string_view>
+#include <charconv>
+#include <thread>
+#include <atomic>
+#include <functional>
 
 // Networking includes
 #include <arpa/inet.h>
@@ -19,6 +27,10 @@
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
 
 // --- Configuration ---
 const char* HOST = "127.0.0.1";
@@ -26,14 +38,68 @@ const int PORT = 11211;
 const int MAX_TOTAL_IN_FLIGHT = 1024; // Max requests across ALL connections
 const int BUFFER_SIZE = 16384; 
 const int DEFAULT_CONNECTIONS = 4;
+const int DEFAULT_THREADS = 1;
 const long UPDATE_INTERVAL = 10000; // How often to print live updates
+const char* DEFAULT_PERCENTILES = "50,90,99,99.9";
+const double LATE_SEND_THRESHOLD_MS = 0.1; // Open-loop sends later than this past their intended time are late
+const long PACER_SPIN_NS = 50000; // Sends due sooner than this are waited for by polling, not by a timer
 
 // --- Data Structures ---
 
+// Command type and key point into the mapped trace, which outlives every request
 struct Request {
-    std::string command_type;
-    std::string key; // Store the key to track dependencies
-    std::chrono::high_resolution_clock::time_point send_time;
+    std::string_view command_type;
+    std::string_view key; // Store the key to track dependencies
+    std::chrono::steady_clock::time_point send_time; // Intended send time in open-loop mode
+};
+
+// Log-linear latency histogram in ns, in the spirit of HdrHistogram
+//  - Latencies below 2^HISTOGRAM_SUB_BUCKET_BITS ns have a bucket each, every power of 2 above is split
+//    into 2^(HISTOGRAM_SUB_BUCKET_BITS - 1) equal buckets, so a bucket is within 1/128 of its latencies
+//  - Fixed size: recording is O(1) and never allocates, merging adds the counts
+const int HISTOGRAM_SUB_BUCKET_BITS = 8;
+const int HISTOGRAM_MAX_BITS = 40; // Up to 2^40 ns (18 minutes), longer latencies are clamped
+const int HISTOGRAM_HALF_BUCKETS = 1 << (HISTOGRAM_SUB_BUCKET_BITS - 1);
+const int HISTOGRAM_BUCKETS = (1 << HISTOGRAM_SUB_BUCKET_BITS) + (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS) * HISTOGRAM_HALF_BUCKETS;
+
+struct LatencyHistogram {
+    std::array<uint64_t, HISTOGRAM_BUCKETS> counts{};
+    uint64_t total = 0;
+
+    static int bucket_of(uint64_t ns) {
+        ns = std::min(ns, (uint64_t(1) << HISTOGRAM_MAX_BITS) - 1);
+        if (ns < (uint64_t(1) << HISTOGRAM_SUB_BUCKET_BITS)) return ns;
+        int shift = (63 - __builtin_clzll(ns)) - HISTOGRAM_SUB_BUCKET_BITS + 1;
+        return (shift << (HISTOGRAM_SUB_BUCKET_BITS - 1)) + (ns >> shift);
+    }
+    // Lowest latency of a bucket, and its width
+    static uint64_t bucket_low(int bucket) {
+        if (bucket < (1 << HISTOGRAM_SUB_BUCKET_BITS)) return bucket;
+        int shift = (bucket >> (HISTOGRAM_SUB_BUCKET_BITS - 1)) - 1;
+        return uint64_t(bucket - (shift << (HISTOGRAM_SUB_BUCKET_BITS - 1))) << shift;
+    }
+    static uint64_t bucket_width(int bucket) {
+        return bucket < (1 << HISTOGRAM_SUB_BUCKET_BITS) ? 1 : uint64_t(1) << ((bucket >> (HISTOGRAM_SUB_BUCKET_BITS - 1)) - 1);
+    }
+
+    void record(uint64_t ns) {
+        counts[bucket_of(ns)]++;
+        total++;
+    }
+    void merge(const LatencyHistogram& other) {
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) counts[b] += other.counts[b];
+        total += other.total;
+    }
+    // Highest latency of the bucket holding the given percentile, in ns
+    uint64_t percentile(double pct) const {
+        uint64_t rank = std::max<uint64_t>(1, std::ceil(pct / 100.0 * total));
+        uint64_t seen = 0;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            seen += counts[b];
+            if (seen >= rank) return bucket_low(b) + bucket_width(b) - 1;
+        }
+        return 0;
+    }
 };
 
 struct Stats {
@@ -42,8 +108,10 @@ struct Stats {
     double max_latency_ms = 0.0;
     double M2 = 0.0;
     double mean = 0.0;
+    LatencyHistogram histogram;
 
     void update(double latency_ms) {
+        histogram.record(std::llround(latency_ms * 1e6));
         count++;
         total_latency_ms += latency_ms;
         max_latency_ms = std::max(max_latency_ms, latency_ms);
@@ -53,6 +121,22 @@ struct Stats {
         M2 += delta * delta2;
     }
 
+    // Combine with the statistics of another thread (parallel form of Welford's update)
+    void merge(const Stats& other) {
+        if (other.count == 0) return;
+        long long n = count + other.count;
+        double delta = other.mean - mean;
+        M2 += other.M2 + delta * delta * count * other.count / n;
+        mean += delta * other.count / n;
+        count = n;
+        total_latency_ms += other.total_latency_ms;
+        max_latency_ms = std::max(max_latency_ms, other.max_latency_ms);
+        histogram.merge(other.histogram);
+    }
+
+    // Latency of a percentile in ms, bounded by the exact maximum
+    double get_percentile(double pct) const { return std::min(histogram.percentile(pct) / 1e6, max_latency_ms); }
+
     double get_average() const { return (count > 0) ? (total_latency_ms / count) : 0.0; }
     double get_variance() const { return (count > 1) ? (M2 / (count - 1)) : 0.0; }
     double get_std_dev() const { return std::sqrt(get_variance()); }
@@ -64,6 +148,117 @@ struct ConnectionState {
     std::queue<Request> in_flight_requests;
     std::string receive_buffer;
     bool is_writable = true; // Start as writable
+    std::string_view unsent;    // Rest of the last request after a short write, sent before the next one
+    std::string unsent_storage; // Holds unsent when the request was built in scratch rather than mapped
+};
+
+// Binary trace, written once from a text trace by --convert and replayed without parsing.
+// Native byte order, laid out as: header | requests[n_requests] | [timestamps[n_requests]] | wire pool | keys[n_keys]
+//  - The wire pool holds every request exactly as it is sent, so values are ranges of it
+//  - Keys are interned: each has an id, its bytes are those of the first request using it
+//  - Timestamps (int64 us) are only written for text traces that have them
+const char BINARY_TRACE_MAGIC[8] = {'M', 'C', 'T', 'R', 'A', 'C', 'E', '2'};
+enum Opcode : uint8_t { OP_GET, OP_SET, OP_ADD, OP_REPLACE };
+const std::string_view OPCODE_NAMES[] = {"get", "set", "add", "replace"};
+
+struct BinaryTraceHeader {
+    char magic[8];
+    uint64_t n_requests;
+    uint64_t n_keys;
+    uint64_t requests_offset;
+    uint64_t wire_offset;
+    uint64_t wire_size;
+    uint64_t keys_offset;
+    uint64_t timestamps_offset; // 0 without timestamps
+};
+
+struct BinaryRequest {
+    uint64_t wire_offset;  // Request bytes in the wire pool, ready to send
+    uint64_t value_offset; // Data of storage commands in the wire pool
+    uint32_t wire_length;
+    uint32_t value_length;
+    uint32_t key_id;       // Index in the key table
+    uint8_t opcode;
+    uint8_t padding[3];
+};
+
+struct BinaryKey {
+    uint64_t offset;       // Key bytes in the wire pool
+    uint32_t length;
+    uint32_t padding;
+};
+
+// Read-only mapping of the trace file, shared by every worker
+struct MappedTrace {
+    const char* data = nullptr;
+    size_t size = 0;
+    // Sections of a binary trace, null for a text trace
+    const BinaryTraceHeader* header = nullptr;
+    const BinaryRequest* requests = nullptr;
+    const BinaryKey* keys = nullptr;
+    const char* wire = nullptr;
+    const int64_t* timestamps = nullptr;
+};
+
+// One request of the trace, parsed in place in the mapping
+struct TraceRequest {
+    std::string_view cmd_type;
+    std::string_view key;
+    std::string_view line1; // Without its line ending (text traces)
+    std::string_view line2; // Data line of storage commands, without its line ending (text traces)
+    std::string_view wire;  // Bytes to send in the mapping, empty if the trace does not use \r\n
+    size_t end = 0;         // Cursor of the next request: offset in a text trace, index in a binary one
+    int64_t key_id = -1;    // Interned key id of a binary trace
+    int64_t timestamp_us = -1; // Intended send time from the start of the replay, -1 without
+    bool is_storage = false;
+};
+
+// Open-loop pacing: each request has an intended send time, from a target rate or from the trace
+// timestamps, and latency is measured from it, so a slow server cannot hold back the load it is
+// measured under (coordinated omission)
+struct Pacing {
+    double rate = 0;          // Requests per second over the whole trace, 0 for none
+    bool timestamps = false;  // Send at the timestamps of the trace
+    std::chrono::steady_clock::time_point start;
+
+    bool enabled() const { return rate > 0 || timestamps; }
+    // Intended send time of the index-th replayed request, whose timestamp (or the last one before) is timestamp_us
+    std::chrono::steady_clock::time_point intended(uint64_t index, int64_t timestamp_us) const {
+        if (timestamps) return start + std::chrono::microseconds(std::max<int64_t>(timestamp_us, 0));
+        return start + std::chrono::nanoseconds(std::llround(index * 1e9 / rate));
+    }
+};
+
+// A request split to a shard: where it starts in the trace, and how it is paced in the whole trace
+struct ShardRequest {
+    size_t pos;              // Cursor of the request in the trace
+    uint64_t trace_index;    // Replayed requests of the whole trace before it, for --rate
+    int64_t timestamp_us;    // Its timestamp, or the last one before it, for --timestamps
+};
+
+// One replay worker: the requests whose key hashes to it, on its own connections and epoll instance.
+// All requests for a key go to the same worker in trace order, so per-key 'add' ordering holds.
+struct ReplayShard {
+    int index = 0;
+    int num_shards = 1;
+    size_t max_in_flight = MAX_TOTAL_IN_FLIGHT;
+    std::vector<ShardRequest> requests; // With several shards, the requests of this one (see split_trace)
+    std::vector<ConnectionState> connections;
+    int epoll_fd = -1;
+
+    // Results, merged by the main thread once the worker is joined
+    std::map<std::string, Stats> statistics;
+    std::map<std::string, Stats> response_stats; // By response class
+    long long stall_count = 0;
+    long total_requests_sent = 0;
+    Stats send_lag;              // Open loop: how late requests were sent past their intended time
+    long long late_sends = 0;    // Open loop: sends more than LATE_SEND_THRESHOLD_MS late
+    bool failed = false;
+
+    // Progress for live updates, read by the main thread while the worker runs
+    std::atomic<long> sent_progress{0};
+    std::atomic<long> in_flight_progress{0};
+    std::atomic<bool> done{false};
 };
 
 
@@ -83,7 +278,313 @@ bool make_socket_non_blocking(int fd) {
     return true;
 }
 
-void print_stats(const std::map<std::string, Stats>& stats_map, const std::map<std::string, long long>& response_map, long long stall_count) {
+// True if length bytes from offset lie within size bytes, without overflowing
+bool range_fits(uint64_t offset, uint64_t length, uint64_t size) {
+    return offset <= size && length <= size - offset;
+}
+
+// True if count elements of element_size bytes from offset lie within size bytes, without overflowing
+bool section_fits(uint64_t offset, uint64_t count, size_t element_size, uint64_t size) {
+    return offset <= size && count <= (size - offset) / element_size;
+}
+
+// Map the whole trace, read front to back
+//  - Only the header and the section bounds of a binary trace are checked here, so opening a trace
+//    stays one mmap. Records are checked as they are loaded (see load_request).
+bool map_trace(const char* filename, MappedTrace& trace) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) { std::cerr << "Error: Could not open trace file '" << filename << "'" << std::endl; return false; }
+    struct stat st;
+    if (fstat(fd, &st) < 0) { perror("fstat"); close(fd); return false; }
+    trace.size = st.st_size;
+    if (trace.size > 0) {
+        void* data = mmap(NULL, trace.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) { perror("mmap"); close(fd); return false; }
+        madvise(data, trace.size, MADV_SEQUENTIAL);
+        trace.data = static_cast<const char*>(data);
+    }
+    close(fd);
+
+    if (trace.size < sizeof(BinaryTraceHeader) || memcmp(trace.data, BINARY_TRACE_MAGIC, sizeof(BINARY_TRACE_MAGIC) - 1) != 0) {
+        return true;
+    }
+    if (trace.data[sizeof(BINARY_TRACE_MAGIC) - 1] != BINARY_TRACE_MAGIC[sizeof(BINARY_TRACE_MAGIC) - 1]) {
+        std::cerr << "Error: '" << filename << "' is an older binary trace, convert the text trace again" << std::endl;
+        return false;
+    }
+    const BinaryTraceHeader* header = reinterpret_cast<const BinaryTraceHeader*>(trace.data);
+    if (!section_fits(header->requests_offset, header->n_requests, sizeof(BinaryRequest), trace.size) ||
+            !section_fits(header->wire_offset, header->wire_size, 1, trace.size) ||
+            !section_fits(header->keys_offset, header->n_keys, sizeof(BinaryKey), trace.size) ||
+            (header->timestamps_offset && !section_fits(header->timestamps_offset, header->n_requests, sizeof(int64_t), trace.size))) {
+        std::cerr << "Error: Truncated binary trace '" << filename << "'" << std::endl;
+        return false;
+    }
+    if (header->requests_offset % alignof(BinaryRequest) != 0 || header->keys_offset % alignof(BinaryKey) != 0 ||
+            header->timestamps_offset % alignof(int64_t) != 0) {
+        std::cerr << "Error: Corrupt binary trace '" << filename << "': misaligned section" << std::endl;
+        return false;
+    }
+    trace.header = header;
+    trace.requests = reinterpret_cast<const BinaryRequest*>(trace.data + header->requests_offset);
+    trace.keys = reinterpret_cast<const BinaryKey*>(trace.data + header->keys_offset);
+    trace.wire = trace.data + header->wire_offset;
+    if (header->timestamps_offset) trace.timestamps = reinterpret_cast<const int64_t*>(trace.data + header->timestamps_offset);
+    return true;
+}
+
+// Next line of the trace from pos, as std::getline reads it. Returns false at the end of the trace.
+bool next_line(const MappedTrace& trace, size_t& pos, std::string_view& line, bool& crlf) {
+    if (pos >= trace.size) return false;
+    const char* start = trace.data + pos;
+    const char* newline = static_cast<const char*>(memchr(start, '\n', trace.size - pos));
+    size_t length = newline ? newline - start : trace.size - pos;
+    pos += newline ? length + 1 : length;
+    crlf = newline && length > 0 && start[length - 1] == '\r';
+    line = std::string_view(start, length > 0 && start[length - 1] == '\r' ? length - 1 : length);
+    return true;
+}
+
+// Next whitespace-separated token of line, removed from it
+std::string_view next_token(std::string_view& line) {
+    size_t begin = line.find_first_not_of(" \t");
+    if (begin == std::string_view::npos) { line = {}; return {}; }
+    size_t end = line.find_first_of(" \t", begin);
+    if (end == std::string_view::npos) end = line.size();
+    std::string_view token = line.substr(begin, end - begin);
+    line.remove_prefix(end);
+    return token;
+}
+
+// Parse the request at pos: a command line and, for storage commands, a data line
+//  - The command line may start with a timestamp, in us from the start of the replay, that is not sent
+//  - Returns false at the end of the trace, or on a storage command missing its data line
+bool parse_request(const MappedTrace& trace, size_t pos, TraceRequest& req) {
+    bool crlf;
+    if (!next_line(trace, pos, req.line1, crlf)) return false;
+    std::string_view tokens = req.line1;
+    std::string_view first = next_token(tokens);
+    req.timestamp_us = -1;
+    if (!first.empty() && first.find_first_not_of("0123456789") == std::string_view::npos) {
+        std::from_chars(first.data(), first.data() + first.size(), req.timestamp_us);
+        size_t command = tokens.find_first_not_of(" \t");
+        req.line1 = command == std::string_view::npos ? std::string_view() : tokens.substr(command);
+    }
+    tokens = req.line1;
+    req.cmd_type = next_token(tokens);
+    req.key = next_token(tokens);
+    req.is_storage = req.cmd_type == "add" || req.cmd_type == "replace" || req.cmd_type == "set";
+    req.line2 = {};
+    if (req.is_storage) {
+        bool crlf2;
+        if (!next_line(trace, pos, req.line2, crlf2)) {
+            std::cerr << "Error: '" << req.cmd_type << "' without its data line at the end of the trace" << std::endl;
+            return false;
+        }
+        crlf = crlf && crlf2;
+    }
+    req.wire = crlf ? std::string_view(req.line1.data(), trace.data + pos - req.line1.data()) : std::string_view();
+    req.end = pos;
+    return true;
+}
+
+// Request pos of a binary trace, a pointer bump: every field is a range of the mapping
+//  - The record is checked first, a few compares: a corrupt record is reported and ends the trace
+//    (see trace_ended)
+bool load_request(const MappedTrace& trace, size_t pos, TraceRequest& req) {
+    if (pos >= trace.header->n_requests) return false;
+    const BinaryRequest& record = trace.requests[pos];
+    uint64_t wire_size = trace.header->wire_size;
+    if (record.key_id >= trace.header->n_keys || record.opcode > OP_REPLACE ||
+            !range_fits(record.wire_offset, record.wire_length, wire_size) ||
+            !range_fits(trace.keys[record.key_id].offset, trace.keys[record.key_id].length, wire_size)) {
+        std::cerr << "Error: Corrupt binary trace: bad request " << pos << std::endl;
+        return false;
+    }
+    const BinaryKey& key = trace.keys[record.key_id];
+    req.cmd_type = OPCODE_NAMES[record.opcode];
+    req.key = std::string_view(trace.wire + key.offset, key.length);
+    req.wire = std::string_view(trace.wire + record.wire_offset, record.wire_length);
+    req.key_id = record.key_id;
+    req.timestamp_us = trace.timestamps ? trace.timestamps[pos] : -1;
+    req.is_storage = record.opcode != OP_GET;
+    req.end = pos + 1;
+    return true;
+}
+
+// Request at cursor pos of a text or binary trace
+bool next_request(const MappedTrace& trace, size_t pos, TraceRequest& req) {
+    return trace.header ? load_request(trace, pos, req) : parse_request(trace, pos, req);
+}
+
+// True if cursor pos is past the last request, false if next_request failed on a bad request there
+bool trace_ended(const MappedTrace& trace, size_t pos) {
+    return pos >= (trace.header ? trace.header->n_requests : trace.size);
+}
+
+// Bytes to send for a request: the mapped bytes when the trace has them, otherwise built in scratch
+std::string_view request_wire(const TraceRequest& req, std::string& scratch) {
+    if (!req.wire.empty()) return req.wire;
+    scratch.assign(req.line1);
+    scratch += "\r\n";
+    if (req.is_storage) {
+        scratch += req.line2;
+        scratch += "\r\n";
+    }
+    return scratch;
+}
+
+// Worker the key of a request is routed to, by interned id in a binary trace
+int shard_of_request(const TraceRequest& req, int num_shards) {
+    if (num_shards == 1) return 0;
+    return (req.key_id >= 0 ? req.key_id : std::hash<std::string_view>()(req.key)) % num_shards;
+}
+
+// Buffered writes at a file offset, for the sections of a binary trace
+struct SectionWriter {
+    int fd;
+    uint64_t offset;
+    std::string buffer;
+
+    bool append(const void* data, size_t size) {
+        buffer.append(static_cast<const char*>(data), size);
+        return buffer.size() < (1 << 20) || flush();
+    }
+    bool flush() {
+        for (size_t done = 0; done < buffer.size();) {
+            ssize_t n = pwrite(fd, buffer.data() + done, buffer.size() - done, offset);
+            if (n < 0) { perror("pwrite"); return false; }
+            done += n;
+            offset += n;
+        }
+        buffer.clear();
+        return true;
+    }
+};
+
+// =================================================================================================
+// Convert a text trace to the binary format
+//  - A first pass sizes the request table and the wire pool, the second writes them and interns
+//    the keys, whose table goes last
+//  - Commands that are not replayed are dropped, requests are rebuilt with \r\n line endings
+//  - If any request has a timestamp, they all get one, that of the previous request if they lack it
+// =================================================================================================
+int convert_trace(const MappedTrace& trace, const char* out_filename) {
+    if (trace.header) { std::cerr << "Error: The trace is already binary" << std::endl; return 1; }
+    auto replayed = [](const TraceRequest& req) { return req.is_storage || req.cmd_type == "get"; };
+    auto wire_length = [](const TraceRequest& req) { return req.line1.size() + 2 + (req.is_storage ? req.line2.size() + 2 : 0); };
+
+    BinaryTraceHeader header = {};
+    memcpy(header.magic, BINARY_TRACE_MAGIC, sizeof(header.magic));
+    TraceRequest req;
+    bool has_timestamps = false;
+    for (size_t pos = 0; parse_request(trace, pos, req); pos = req.end) {
+        if (!replayed(req)) continue;
+        if (wire_length(req) > UINT32_MAX) { std::cerr << "Error: Request too long at offset " << pos << std::endl; return 1; }
+        header.n_requests++;
+        header.wire_size += wire_length(req);
+        has_timestamps = has_timestamps || req.timestamp_us >= 0;
+    }
+    header.requests_offset = sizeof(header);
+    header.wire_offset = header.requests_offset + header.n_requests * sizeof(BinaryRequest);
+    if (has_timestamps) {
+        header.timestamps_offset = header.wire_offset;
+        header.wire_offset += header.n_requests * sizeof(int64_t);
+    }
+    header.keys_offset = (header.wire_offset + header.wire_size + 7) & ~(uint64_t) 7;
+
+    int fd = open(out_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror("open binary trace"); return 1; }
+    SectionWriter requests = {fd, header.requests_offset, {}};
+    SectionWriter wire = {fd, header.wire_offset, {}};
+    SectionWriter timestamps = {fd, header.timestamps_offset, {}};
+    int64_t timestamp_us = 0;
+    std::unordered_map<std::string_view, uint32_t> key_ids;
+    std::vector<BinaryKey> keys;
+    std::string scratch;
+    uint64_t wire_offset = 0;
+    bool ok = true;
+    for (size_t pos = 0; ok && parse_request(trace, pos, req); pos = req.end) {
+        if (!replayed(req)) continue;
+        std::string_view bytes = request_wire(req, scratch);
+        BinaryRequest record = {};
+        record.wire_offset = wire_offset;
+        record.wire_length = bytes.size();
+        record.value_offset = wire_offset + req.line1.size() + 2;
+        record.value_length = req.is_storage ? req.line2.size() : 0;
+        record.opcode = req.cmd_type == "get" ? OP_GET : req.cmd_type == "set" ? OP_SET : req.cmd_type == "add" ? OP_ADD : OP_REPLACE;
+        auto inserted = key_ids.emplace(req.key, keys.size());
+        if (inserted.second) {
+            keys.push_back({wire_offset + (req.key.data() - req.line1.data()), (uint32_t) req.key.size(), 0});
+        }
+        record.key_id = inserted.first->second;
+        ok = requests.append(&record, sizeof(record)) && wire.append(bytes.data(), bytes.size());
+        if (has_timestamps) {
+            if (req.timestamp_us >= 0) timestamp_us = req.timestamp_us;
+            ok = ok && timestamps.append(&timestamp_us, sizeof(timestamp_us));
+        }
+        wire_offset += bytes.size();
+    }
+    header.n_keys = keys.size();
+    SectionWriter tail = {fd, header.keys_offset, {}};
+    ok = ok && requests.flush() && wire.flush() && timestamps.flush() && tail.append(keys.data(), keys.size() * sizeof(BinaryKey)) && tail.flush();
+    ok = ok && pwrite(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header);
+    if (close(fd) < 0 || !ok) { std::cerr << "Error: Failed to write '" << out_filename << "'" << std::endl; return 1; }
+    std::cout << "Converted " << header.n_requests << " requests with " << header.n_keys << " distinct keys to " << out_filename << std::endl;
+    return 0;
+}
+
+// Comma separated percentiles in (0, 100]
+bool parse_percentiles(const std::string& list, std::vector<double>& percentiles) {
+    percentiles.clear();
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t end = std::min(list.find(',', begin), list.size());
+        std::string value = list.substr(begin, end - begin);
+        char* parse_end;
+        double pct = strtod(value.c_str(), &parse_end);
+        if (value.empty() || *parse_end != '\0' || !(pct > 0 && pct <= 100)) {
+            std::cerr << "Invalid percentile: " << value << std::endl;
+            return false;
+        }
+        percentiles.push_back(pct);
+        begin = end + 1;
+    }
+    return true;
+}
+
+void print_percentiles(const Stats& stats, const std::vector<double>& percentiles, const char* indent, const char* name = "Latency", int width = 20) {
+    for (double pct : percentiles) {
+        std::ostringstream label;
+        label << "p" << pct << " " << name << ":";
+        std::cout << indent << std::left << std::setw(width) << label.str() << std::right << std::fixed << stats.get_percentile(pct) << " ms\n";
+    }
+}
+
+// Dump every histogram as CSV, one row per non-empty bucket: the series is "command:<type>" or
+// "response:<class>", bucket bounds in ms, count and the cumulative fraction of the series
+bool write_histograms_csv(const char* filename, const std::map<std::string, Stats>& stats_map, const std::map<std::string, Stats>& response_map) {
+    std::ofstream out(filename);
+    if (!out.is_open()) { std::cerr << "Error: Could not open '" << filename << "'" << std::endl; return false; }
+    out << "Series,Low-ms,High-ms,Count,Cumulative\n" << std::setprecision(9);
+    auto dump = [&](const std::string& series, const LatencyHistogram& histogram) {
+        uint64_t seen = 0;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            if (histogram.counts[b] == 0) continue;
+            seen += histogram.counts[b];
+            out << series << "," << LatencyHistogram::bucket_low(b) / 1e6 << ","
+                << (LatencyHistogram::bucket_low(b) + LatencyHistogram::bucket_width(b)) / 1e6 << ","
+                << histogram.counts[b] << "," << double(seen) / histogram.total << "\n";
+        }
+    };
+    for (const auto& pair : stats_map) dump("command:" + pair.first, pair.second.histogram);
+    for (const auto& pair : response_map) dump("response:" + pair.first, pair.second.histogram);
+    return out.good();
+}
+
+void print_stats(const std::map<std::string, Stats>& stats_map, const std::map<std::string, Stats>& response_map, long long stall_count,
+                 long total_requests_sent, double elapsed_s, int num_threads, const std::vector<double>& percentiles,
+                 const Pacing& pacing, const Stats& send_lag, long long late_sends) {
     std::cout << "\n--- Trace Replay Finished ---\n";
     std::cout << "\n--- Performance Statistics ---\n";
     for (const auto& pair : stats_map) {
@@ -96,6 +597,7 @@ void print_stats(const std::map<std::string, Stats>& stats_map, const std::map<s
             std::cout << "  - Average Latency:    " << std::fixed << stats.get_average() << " ms\n";
             std::cout << "  - Maximum Latency:    " << std::fixed << stats.max_latency_ms << " ms\n";
             std::cout << "  - Latency Std Dev:    " << std::fixed << stats.get_std_dev() << " ms\n";
+            print_percentiles(stats, percentiles, "  - ");
         }
     }
     std::cout << "--------------------------------\n";
@@ -103,13 +605,29 @@ void print_stats(const std::map<std::string, Stats>& stats_map, const std::map<s
     if (!response_map.empty()) {
         std::cout << "\n--- Server Response Counts ---\n";
         for (const auto& pair : response_map) {
-            std::cout << "  - " << pair.first << ": " << pair.second << "\n";
+            std::cout << "  - " << pair.first << ": " << pair.second.count << "\n";
+            print_percentiles(pair.second, percentiles, "      ");
         }
         std::cout << "--------------------------------\n";
     }
 
     std::cout << "\n--- Replay Metrics ---\n";
     std::cout << "  - Stalls on pending keys: " << stall_count << "\n";
+    std::cout << "  - Requests Sent:          " << total_requests_sent << "\n";
+    std::cout << "  - Replay Threads:         " << num_threads << "\n";
+    std::cout << "  - Elapsed Time:           " << std::fixed << elapsed_s << " s\n";
+    std::cout << "  - Throughput:             " << std::fixed << (elapsed_s > 0 ? total_requests_sent / elapsed_s : 0.0) << " req/s\n";
+    if (pacing.enabled()) {
+        std::cout << "  - Open-Loop Schedule:     ";
+        if (pacing.timestamps) std::cout << "trace timestamps\n";
+        else std::cout << std::fixed << pacing.rate << " req/s\n";
+        std::cout << "  - Late Sends:             " << late_sends << " (" << std::setprecision(2)
+                  << (total_requests_sent > 0 ? 100.0 * late_sends / total_requests_sent : 0.0) << std::setprecision(6)
+                  << "% more than " << std::defaultfloat << LATE_SEND_THRESHOLD_MS << std::fixed << " ms late)\n";
+        std::cout << "  - Average Send Lag:       " << std::fixed << send_lag.get_average() << " ms\n";
+        std::cout << "  - Maximum Send Lag:       " << std::fixed << send_lag.max_latency_ms << " ms\n";
+        print_percentiles(send_lag, percentiles, "  - ", "Send Lag", 24);
+    }
     std::cout << "--------------------------------\n";
 }
 
@@ -117,20 +635,20 @@ void print_stats(const std::map<std::string, Stats>& stats_map, const std::map<s
 bool process_responses_for_connection(
     ConnectionState& conn, 
     std::map<std::string, Stats>& stats, 
-    std::map<std::string, long long>& responses,
-    std::unordered_set<std::string>& pending_add_keys) 
+    std::map<std::string, Stats>& responses,
+    std::unordered_set<std::string_view>& pending_add_keys) 
 {
     if (conn.in_flight_requests.empty()) return false;
 
     size_t end_of_line_pos = conn.receive_buffer.find("\r\n");
     if (end_of_line_pos == std::string::npos) return false;
 
-    std::string response_line = conn.receive_buffer.substr(0, end_of_line_pos);
+    std::string_view response_line = std::string_view(conn.receive_buffer).substr(0, end_of_line_pos);
     const auto& current_request = conn.in_flight_requests.front();
     
     bool request_finished = false;
     bool is_success = false;
-    std::string response_key;
+    const char* response_key = "";
     size_t consumed_len = 0;
 
     if (current_request.command_type == "get") {
@@ -139,14 +657,16 @@ bool process_responses_for_connection(
             response_key = "NOT_FOUND (END)";
             consumed_len = end_of_line_pos + 2;
         } else if (response_line.rfind("VALUE ", 0) == 0) {
-            std::stringstream ss(response_line);
-            std::string token;
+            // VALUE <key> <flags> <bytes>
+            std::string_view tokens = response_line;
+            for (int t = 0; t < 3; t++) next_token(tokens);
+            std::string_view length_token = next_token(tokens);
             long long data_len = -1;
-            ss >> token >> token >> token >> data_len;
+            std::from_chars(length_token.data(), length_token.data() + length_token.size(), data_len);
             if (data_len >= 0) {
                 size_t data_start = end_of_line_pos + 2;
                 size_t expected_end_pos = data_start + data_len + 2 + 5; // data + \r\n + END\r\n
-                if (conn.receive_buffer.length() >= expected_end_pos && conn.receive_buffer.substr(data_start + data_len + 2, 5) == "END\r\n") {
+                if (conn.receive_buffer.length() >= expected_end_pos && conn.receive_buffer.compare(data_start + data_len + 2, 5, "END\r\n") == 0) {
                     request_finished = true;
                     is_success = true;
                     response_key = "FOUND (VALUE)";
@@ -170,11 +690,11 @@ bool process_responses_for_connection(
     }
 
     if (request_finished) {
+        auto latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - current_request.send_time);
         if (is_success) {
-            auto latency = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - current_request.send_time);
-            stats[current_request.command_type].update(latency.count());
+            stats[std::string(current_request.command_type)].update(latency.count());
         }
-        responses[response_key]++;
+        responses[response_key].update(latency.count());
 
         // *** UNLOCK KEY ***: If this was an 'add', remove its key from the pending set
         if (current_request.command_type == "add") {
@@ -189,14 +709,15 @@ bool process_responses_for_connection(
 }
 
 // Function to change epoll monitoring mode
+//  - Connections with the rest of a request to send keep EPOLLOUT, the stall may wait on its response
 void set_epoll_mode(int epoll_fd, std::vector<ConnectionState>& connections, bool send_enabled) {
     struct epoll_event event;
-    event.events = EPOLLIN | EPOLLET; // Always listen for input
-    if (send_enabled) {
-        event.events |= EPOLLOUT;
-    }
 
     for (auto& conn : connections) {
+        event.events = EPOLLIN | EPOLLET; // Always listen for input
+        if (send_enabled || !conn.unsent.empty()) {
+            event.events |= EPOLLOUT;
+        }
         event.data.ptr = &conn;
         if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &event) == -1) {
             perror("epoll_ctl_mod");
@@ -205,76 +726,108 @@ void set_epoll_mode(int epoll_fd, std::vector<ConnectionState>& connections, boo
 }
 
 
-// --- Main Logic ---
-
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <trace_file> [--live] [-c|--connections <N>]" << std::endl;
-        return 1;
-    }
-    const char* trace_filename = argv[1];
-    bool live_updates_enabled = false;
-    int num_connections = DEFAULT_CONNECTIONS;
-
-    for (int i = 2; i < argc; ++i) {
-        std::string arg = argv[i];
-        if (arg == "--live") { live_updates_enabled = true; } 
-        else if (arg == "-c" || arg == "--connections") {
-            if (i + 1 < argc) {
-                try { num_connections = std::stoi(argv[++i]); } 
-                catch (const std::exception& e) { std::cerr << "Invalid number for connections: " << e.what() << std::endl; return 1; }
-            }
+// Write out the rest of a request a short write left on conn
+//  - Returns false while bytes remain: the socket is full (conn is no longer writable) or the write
+//    failed (reported, error set)
+bool flush_unsent(ConnectionState& conn, bool& error) {
+    while (!conn.unsent.empty()) {
+        ssize_t bytes_sent = write(conn.fd, conn.unsent.data(), conn.unsent.length());
+        if (bytes_sent > 0) {
+            conn.unsent.remove_prefix(bytes_sent);
+        } else if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            conn.is_writable = false;
+            return false;
+        } else if (bytes_sent == -1 && errno != EINTR) {
+            perror("write");
+            error = true;
+            return false;
         }
     }
+    return true;
+}
 
-    std::ifstream trace_file(trace_filename);
-    if (!trace_file.is_open()) { std::cerr << "Error: Could not open trace file '" << trace_filename << "'" << std::endl; return 1; }
-
-    std::vector<ConnectionState> connections(num_connections);
-    int epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1) { perror("epoll_create1"); return 1; }
+// Open the connections and epoll instance of a shard
+bool connect_shard(ReplayShard& shard, int num_connections) {
+    shard.connections.resize(num_connections);
+    shard.epoll_fd = epoll_create1(0);
+    if (shard.epoll_fd == -1) { perror("epoll_create1"); return false; }
 
     for (int i = 0; i < num_connections; ++i) {
         int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock_fd < 0) { perror("socket"); return 1; }
+        if (sock_fd < 0) { perror("socket"); return false; }
         struct sockaddr_in serv_addr;
         memset(&serv_addr, 0, sizeof(serv_addr));
         serv_addr.sin_family = AF_INET;
         serv_addr.sin_port = htons(PORT);
         inet_pton(AF_INET, HOST, &serv_addr.sin_addr);
-        if (connect(sock_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) { perror("connect"); return 1; }
+        if (connect(sock_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) { perror("connect"); close(sock_fd); return false; }
         make_socket_non_blocking(sock_fd);
-        connections[i].fd = sock_fd;
+        shard.connections[i].fd = sock_fd;
         struct epoll_event event;
         event.events = EPOLLIN | EPOLLOUT | EPOLLET;
-        event.data.ptr = &connections[i];
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &event) == -1) { perror("epoll_ctl_add"); return 1; }
+        event.data.ptr = &shard.connections[i];
+        if (epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, sock_fd, &event) == -1) { perror("epoll_ctl_add"); return false; }
     }
-    std::cout << "Established " << num_connections << " connections to " << HOST << ":" << PORT << std::endl;
+    return true;
+}
 
-    std::map<std::string, Stats> statistics;
-    std::map<std::string, long long> response_counts;
+// Replay the requests of one shard of the trace
+//  - A single shard streams the whole trace, several replay the requests split to them up front, so
+//    each worker only parses its own share of the trace
+//  - Requests are parsed in place, or read from a binary trace, and sent from the mapping; a stall
+//    keeps the cursor on the request
+//  - A short write leaves the rest of the request on its connection, which sends nothing else until
+//    it is written out. The request is in flight from its first byte.
+//  - With a single shard, live updates are printed here; with several, the main thread prints them
+//  - Open loop: a request is not sent before its intended time, nor held back past it by anything
+//    but a stall, a full socket or the in-flight limit. A timerfd wakes the loop for the next send,
+//    sends due within PACER_SPIN_NS are polled for instead.
+void replay_shard(const MappedTrace& trace, ReplayShard& shard, bool live_updates_enabled, const Pacing& pacing) {
+    std::vector<ConnectionState>& connections = shard.connections;
+    int num_connections = connections.size();
+    int epoll_fd = shard.epoll_fd;
+    int timer_fd = -1;
+    if (pacing.enabled()) {
+        prctl(PR_SET_TIMERSLACK, 1); // Timer wakeups to the ns instead of the default 50 us of slack
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        if (timer_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) == -1) {
+            perror("timerfd");
+            shard.failed = true;
+            shard.done = true;
+            return;
+        }
+    }
+    uint64_t trace_index = 0;   // Replayed requests of the whole trace before the cursor, for --rate
+    int64_t last_timestamp_us = 0;
+    int epoll_timeout = -1;
     // NOTE: This assumes the trace does not contain multiple concurrent 'add' requests for the same key.
     // A more robust implementation for arbitrary traces would use a map to count pending adds per key.
-    std::unordered_set<std::string> pending_add_keys;
+    std::unordered_set<std::string_view> pending_add_keys;
+    size_t cursor = 0;      // Next request to send: offset in the trace, index in shard.requests with several shards
+    std::string scratch;    // Requests of traces without \r\n line endings
     bool trace_file_done = false;
-    long total_requests_sent = 0;
     size_t next_connection_idx = 0;
     size_t total_in_flight = 0;
     long last_update_req_count = 0;
-    std::string stalled_on_key = "";
-    long long stall_count = 0;
-
-    if (!live_updates_enabled) { std::cout << "Live updates disabled. Use --live to enable." << std::endl; }
+    std::string_view stalled_on_key;
 
     while (!trace_file_done || total_in_flight > 0) {
         struct epoll_event events[num_connections * 2];
-        int n_events = epoll_wait(epoll_fd, events, num_connections * 2, -1);
+        int n_events = epoll_wait(epoll_fd, events, num_connections * 2, epoll_timeout);
+        epoll_timeout = -1;
 
         if (n_events == -1) { if (errno == EINTR) continue; perror("epoll_wait"); break; }
 
         for (int i = 0; i < n_events; ++i) {
             ConnectionState* conn = static_cast<ConnectionState*>(events[i].data.ptr);
+            if (!conn) { // Pacer timer
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) perror("read timerfd");
+                continue;
+            }
             if (events[i].events & EPOLLIN) {
                 char read_buffer[BUFFER_SIZE];
                 while (true) {
@@ -287,68 +840,128 @@ int main(int argc, char* argv[]) {
         }
         
         for(auto& conn : connections) {
-            while(process_responses_for_connection(conn, statistics, response_counts, pending_add_keys));
+            while(process_responses_for_connection(conn, shard.statistics, shard.response_stats, pending_add_keys));
         }
 
         total_in_flight = 0;
         for(const auto& conn : connections) total_in_flight += conn.in_flight_requests.size();
 
+        // Finish the requests short writes left behind, their responses cannot come before
+        bool write_error = false;
+        for (auto& conn : connections) {
+            if (conn.is_writable && !conn.unsent.empty()) flush_unsent(conn, write_error);
+        }
+        if (write_error) {
+            shard.failed = true;
+            break;
+        }
+
         // Check if we were stalled and if the key is now free
         if (!stalled_on_key.empty() && pending_add_keys.count(stalled_on_key) == 0) {
-            stalled_on_key = "";
+            stalled_on_key = {};
             set_epoll_mode(epoll_fd, connections, true); // Re-enable sending
         }
 
-        while (stalled_on_key.empty() && total_in_flight < MAX_TOTAL_IN_FLIGHT && !trace_file_done) {
+        while (stalled_on_key.empty() && total_in_flight < shard.max_in_flight && !trace_file_done) {
             ConnectionState& conn = connections[next_connection_idx];
-            if (!conn.is_writable) break;
+            if (!conn.is_writable || !conn.unsent.empty()) break;
 
-            std::streampos before_read_pos = trace_file.tellg();
-            std::string line1, line2;
-            if (!std::getline(trace_file, line1)) { trace_file_done = true; break; }
-            if (!line1.empty() && line1.back() == '\r') line1.pop_back();
+            TraceRequest req;
+            if (shard.num_shards > 1) {
+                if (cursor >= shard.requests.size()) { trace_file_done = true; break; }
+                const ShardRequest& next = shard.requests[cursor];
+                if (!next_request(trace, next.pos, req)) {
+                    // Loaded once already by split_trace
+                    std::cerr << "Error: shard " << shard.index << " could not reload the request at " << next.pos
+                              << " of the trace split to it" << std::endl;
+                    shard.failed = true;
+                    trace_file_done = true;
+                    break;
+                }
+                req.end = cursor + 1;
+                trace_index = next.trace_index;
+                last_timestamp_us = next.timestamp_us;
+            } else {
+                if (!next_request(trace, cursor, req)) {
+                    if (!trace_ended(trace, cursor)) shard.failed = true;
+                    trace_file_done = true;
+                    break;
+                }
 
-            std::string full_command, cmd_type, key;
-            std::stringstream ss(line1);
-            ss >> cmd_type >> key;
+                // Commands that are not replayed
+                if (req.timestamp_us >= 0) last_timestamp_us = req.timestamp_us;
+                if (!req.is_storage && req.cmd_type != "get") {
+                    cursor = req.end;
+                    continue;
+                }
+            }
 
-            if (pending_add_keys.count(key)) {
-                stalled_on_key = key;
-                stall_count++;
+            // Open loop: wait for the intended send time
+            auto now = std::chrono::steady_clock::now();
+            auto send_time = now;
+            if (pacing.enabled()) {
+                send_time = pacing.intended(trace_index, last_timestamp_us);
+                if (send_time > now) {
+                    long wait_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(send_time - now).count();
+                    if (wait_ns < PACER_SPIN_NS) {
+                        epoll_timeout = 0;
+                    } else {
+                        struct itimerspec spec = {};
+                        long due_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(send_time.time_since_epoch()).count();
+                        spec.it_value.tv_sec = due_ns / 1000000000;
+                        spec.it_value.tv_nsec = due_ns % 1000000000;
+                        if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) perror("timerfd_settime");
+                    }
+                    break;
+                }
+            }
+
+            if (pending_add_keys.count(req.key)) {
+                stalled_on_key = req.key;
+                shard.stall_count++;
                 set_epoll_mode(epoll_fd, connections, false); // Disable sending
-                trace_file.clear();
-                trace_file.seekg(before_read_pos);
                 break;
             }
 
-            if (cmd_type == "add" || cmd_type == "replace" || cmd_type == "set") {
-                if (!std::getline(trace_file, line2)) { trace_file_done = true; break; }
-                if (!line2.empty() && line2.back() == '\r') line2.pop_back();
-                full_command = line1 + "\r\n" + line2 + "\r\n";
-            } else if (cmd_type == "get") {
-                full_command = line1 + "\r\n";
-            } else { continue; }
-
-            ssize_t bytes_sent = write(conn.fd, full_command.c_str(), full_command.length());
+            std::string_view full_command = request_wire(req, scratch);
+            ssize_t bytes_sent = write(conn.fd, full_command.data(), full_command.length());
             if (bytes_sent > 0) {
-                if (cmd_type == "add") { pending_add_keys.insert(key); }
-                conn.in_flight_requests.push({cmd_type, key, std::chrono::high_resolution_clock::now()});
-                total_requests_sent++;
+                if ((size_t) bytes_sent < full_command.length()) {
+                    conn.unsent = full_command.substr(bytes_sent);
+                    if (full_command.data() == scratch.data()) {
+                        conn.unsent_storage.assign(conn.unsent);
+                        conn.unsent = conn.unsent_storage;
+                    }
+                }
+                if (req.cmd_type == "add") { pending_add_keys.insert(req.key); }
+                conn.in_flight_requests.push({req.cmd_type, req.key, send_time});
+                cursor = req.end;
+                trace_index++;
+                if (pacing.enabled()) {
+                    double lag_ms = std::chrono::duration<double, std::milli>(now - send_time).count();
+                    shard.send_lag.update(lag_ms);
+                    if (lag_ms > LATE_SEND_THRESHOLD_MS) shard.late_sends++;
+                }
+                shard.total_requests_sent++;
                 total_in_flight++;
                 next_connection_idx = (next_connection_idx + 1) % num_connections;
             } else if (bytes_sent == -1) {
                 if (errno == EAGAIN || errno == EWOULDBLOCK) {
                     conn.is_writable = false;
-                    trace_file.clear();
-                    trace_file.seekg(before_read_pos);
                     break;
                 }
-                perror("write"); goto cleanup;
+                perror("write");
+                shard.failed = true;
+                trace_file_done = true;
+                total_in_flight = 0;
+                break;
             }
         }
 
-        if (live_updates_enabled && (total_requests_sent - last_update_req_count) >= UPDATE_INTERVAL) {
-            std::cout << "Sent: " << total_requests_sent << " | In-Flight: " << total_in_flight << " | Pending Adds: " << pending_add_keys.size();
+        shard.sent_progress.store(shard.total_requests_sent, std::memory_order_relaxed);
+        shard.in_flight_progress.store(total_in_flight, std::memory_order_relaxed);
+        if (live_updates_enabled && shard.num_shards == 1 && (shard.total_requests_sent - last_update_req_count) >= UPDATE_INTERVAL) {
+            std::cout << "Sent: " << shard.total_requests_sent << " | In-Flight: " << total_in_flight << " | Pending Adds: " << pending_add_keys.size();
             if(!stalled_on_key.empty()) {
                 std::cout << " | Stalled on: " << stalled_on_key;
             }
@@ -356,17 +969,170 @@ int main(int argc, char* argv[]) {
                 std::cout << "\t\t\t";
             }
             std::cout << "  \r" << std::flush;
-            last_update_req_count = total_requests_sent;
+            last_update_req_count = shard.total_requests_sent;
         }
     }
+    if (timer_fd >= 0) close(timer_fd);
+    shard.done = true;
+}
+
+// Split the replayed requests of the trace across the shards by key, in a single pass
+//  - Requests keep their index and timestamp in the whole trace, so the shards pace them together
+//    as one open-loop stream
+//  - Returns false if a bad request stopped the split before the end of the trace
+bool split_trace(const MappedTrace& trace, std::vector<ReplayShard>& shards) {
+    if (trace.header) {
+        for (auto& shard : shards) shard.requests.reserve(trace.header->n_requests / shards.size() * 2);
+    }
+    uint64_t trace_index = 0;
+    int64_t last_timestamp_us = 0;
+    TraceRequest req;
+    size_t pos = 0;
+    for (; next_request(trace, pos, req); pos = req.end) {
+        if (req.timestamp_us >= 0) last_timestamp_us = req.timestamp_us;
+        if (!req.is_storage && req.cmd_type != "get") continue;
+        shards[shard_of_request(req, shards.size())].requests.push_back({pos, trace_index++, last_timestamp_us});
+    }
+    return trace_ended(trace, pos);
+}
+
+
+// --- Main Logic ---
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <trace_file> [--live] [-c|--connections <N>] [-t|--threads <N>] [--percentiles <p,p,...>] [--histogram-csv <file>] [--rate <req/s>|--timestamps]" << std::endl;
+        std::cerr << "       " << argv[0] << " <text_trace_file> --convert <binary_trace_file>" << std::endl;
+        return 1;
+    }
+    const char* trace_filename = argv[1];
+    bool live_updates_enabled = false;
+    int num_connections = DEFAULT_CONNECTIONS;
+    int num_threads = DEFAULT_THREADS;
+    const char* convert_filename = nullptr;
+    std::vector<double> percentiles;
+    parse_percentiles(DEFAULT_PERCENTILES, percentiles);
+    const char* histogram_csv = nullptr;
+    Pacing pacing;
+
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--live") { live_updates_enabled = true; } 
+        else if (arg == "-c" || arg == "--connections") {
+            if (i + 1 < argc) {
+                try { num_connections = std::stoi(argv[++i]); } 
+                catch (const std::exception& e) { std::cerr << "Invalid number for connections: " << e.what() << std::endl; return 1; }
+            }
+        }
+        else if (arg == "--convert" && i + 1 < argc) { convert_filename = argv[++i]; }
+        else if (arg == "--percentiles" && i + 1 < argc) { if (!parse_percentiles(argv[++i], percentiles)) return 1; }
+        else if (arg == "--histogram-csv" && i + 1 < argc) { histogram_csv = argv[++i]; }
+        else if (arg == "--rate" && i + 1 < argc) {
+            try { pacing.rate = std::stod(argv[++i]); }
+            catch (const std::exception& e) { std::cerr << "Invalid request rate: " << e.what() << std::endl; return 1; }
+            if (!(pacing.rate > 0)) { std::cerr << "Invalid request rate: " << pacing.rate << std::endl; return 1; }
+        }
+        else if (arg == "--timestamps") { pacing.timestamps = true; }
+        else if (arg == "-t" || arg == "--threads") {
+            if (i + 1 < argc) {
+                try { num_threads = std::stoi(argv[++i]); }
+                catch (const std::exception& e) { std::cerr << "Invalid number for threads: " << e.what() << std::endl; return 1; }
+            }
+        }
+    }
+    if (num_threads < 1 || num_connections < num_threads) {
+        std::cerr << "Error: need at least one thread and one connection per thread" << std::endl;
+        return 1;
+    }
+
+    // Text traces are parsed in place, binary traces (see --convert) are replayed as they are
+    MappedTrace trace;
+    if (!map_trace(trace_filename, trace)) return 1;
+    if (convert_filename) return convert_trace(trace, convert_filename);
+    if (pacing.rate > 0 && pacing.timestamps) {
+        std::cerr << "Error: --rate and --timestamps are two open-loop schedules, pick one" << std::endl;
+        return 1;
+    }
+    TraceRequest first_request;
+    if (pacing.timestamps && !(trace.header ? trace.timestamps != nullptr : parse_request(trace, 0, first_request) && first_request.timestamp_us >= 0)) {
+        std::cerr << "Error: --timestamps needs a trace whose requests start with a timestamp" << std::endl;
+        return 1;
+    }
+
+    // Connections and the in-flight limit are split evenly across the workers
+    std::vector<ReplayShard> shards(num_threads);
+    for (int t = 0; t < num_threads; ++t) {
+        ReplayShard& shard = shards[t];
+        shard.index = t;
+        shard.num_shards = num_threads;
+        shard.max_in_flight = std::max(1, MAX_TOTAL_IN_FLIGHT / num_threads);
+        if (!connect_shard(shard, num_connections / num_threads + (t < num_connections % num_threads))) return 1;
+    }
+    std::cout << "Established " << num_connections << " connections to " << HOST << ":" << PORT;
+    if (num_threads > 1) std::cout << " across " << num_threads << " threads";
+    std::cout << std::endl;
+    if (num_threads > 1 && !split_trace(trace, shards)) return 1;
+
+    if (!live_updates_enabled) { std::cout << "Live updates disabled. Use --live to enable." << std::endl; }
+
+    auto start_time = std::chrono::steady_clock::now();
+    pacing.start = start_time;
+    std::vector<std::thread> workers;
+    for (int t = 1; t < num_threads; ++t) {
+        workers.emplace_back(replay_shard, std::cref(trace), std::ref(shards[t]), live_updates_enabled, std::cref(pacing));
+    }
+    if (num_threads == 1) {
+        replay_shard(trace, shards[0], live_updates_enabled, pacing);
+    } else {
+        workers.emplace_back(replay_shard, std::cref(trace), std::ref(shards[0]), live_updates_enabled, std::cref(pacing));
+        // Live updates summed over the workers
+        long last_update_req_count = 0;
+        for (bool all_done = false; !all_done;) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            all_done = true;
+            long sent = 0, in_flight = 0;
+            for (const auto& shard : shards) {
+                all_done = all_done && shard.done;
+                sent += shard.sent_progress.load(std::memory_order_relaxed);
+                in_flight += shard.in_flight_progress.load(std::memory_order_relaxed);
+            }
+            if (live_updates_enabled && sent - last_update_req_count >= UPDATE_INTERVAL) {
+                std::cout << "Sent: " << sent << " | In-Flight: " << in_flight << "\t\t\t  \r" << std::flush;
+                last_update_req_count = sent;
+            }
+        }
+    }
+    for (auto& worker : workers) worker.join();
+    double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    // Merge the per-thread statistics
+    std::map<std::string, Stats> statistics;
+    std::map<std::string, Stats> response_stats;
+    long long stall_count = 0;
+    long total_requests_sent = 0;
+    Stats send_lag;
+    long long late_sends = 0;
+    bool failed = false;
+    for (const auto& shard : shards) {
+        for (const auto& pair : shard.statistics) statistics[pair.first].merge(pair.second);
+        for (const auto& pair : shard.response_stats) response_stats[pair.first].merge(pair.second);
+        stall_count += shard.stall_count;
+        total_requests_sent += shard.total_requests_sent;
+        send_lag.merge(shard.send_lag);
+        late_sends += shard.late_sends;
+        failed = failed || shard.failed;
+    }
 
-cleanup:
     std::cout << "\nTrace file processed. Draining final responses..." << std::endl;
-    print_stats(statistics, response_counts, stall_count);
+    print_stats(statistics, response_stats, stall_count, total_requests_sent, elapsed_s, num_threads, percentiles,
+                pacing, send_lag, late_sends);
+    if (histogram_csv && !write_histograms_csv(histogram_csv, statistics, response_stats)) failed = true;
 
-    for(auto& conn : connections) close(conn.fd);
-    close(epoll_fd);
-    trace_file.close();
+    for (auto& shard : shards) {
+        for(auto& conn : shard.connections) close(conn.fd);
+        close(shard.epoll_fd);
+    }
+    if (trace.data) munmap(const_cast<char*>(trace.data), trace.size);
 
-    return 0;
+    return failed ? 1 : 0;
 }
@@ -0,0 +1,120 @@
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <algorithm>
+#include <poll.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#include "pmap.h"
+
+using namespace std;
+
+// Time since pid started in seconds, the same value ps reports as etime
+static bool process_elapsed(pid_t pid, double &elapsed) {
+    char stat_file[BUFSIZ];
+    snprintf(stat_file, sizeof(stat_file), "/proc/%ju/stat", (uintmax_t)pid);
+    ifstream stat(stat_file);
+    string line;
+    if (!getline(stat, line)) {
+        return false;
+    }
+
+    // The command name may contain spaces, fields are counted from the closing parenthesis
+    //  - starttime is field 22, the 20th after the name (state is the 1st)
+    size_t name_end = line.rfind(')');
+    if (name_end == string::npos) {
+        return false;
+    }
+    istringstream fields(line.substr(name_end + 2));
+    string field;
+    for (int i = 0; i < 19 && fields >> field; i++);
+    unsigned long long start_ticks;
+    if (!(fields >> start_ticks)) {
+        return false;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    elapsed = now.tv_sec + now.tv_nsec / 1e9 - double(start_ticks) / sysconf(_SC_CLK_TCK);
+    return true;
+}
+
+// Same header loop.sh prints, one column per power-of-2 size
+void print_header(ostream &out, const string &key, const string &extra) {
+    out << key << ",Tracked-VSize,Tracked-RSS,Total-RSS,n_mappings";
+    for (int order = CONT_LOWEST; order <= max_order; order++) {
+        out << "," << order_name(order);
+    }
+    if (!extra.empty()) out << "," << extra;
+    out << endl;
+}
+
+// =================================================================================================
+// Sample a process every interval_ms until it exits
+//  - Samples are scheduled by a timerfd, so the interval does not drift with the scan time.
+//    Intervals missed while a sample runs long are skipped, not queued.
+//  - Exit of the target is detected through a pidfd, or by the sample failing on kernels without it
+//  - Each sample prints one CSV row, "Time,<sample row>", flushed immediately. A sample that fails
+//    while the process is alive is reported on stderr and prints "Time" followed by empty fields.
+// =================================================================================================
+int run_daemon(pid_t pid, long interval_ms, const string &extra, const function<bool(ostream &, double)> &sample) {
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        perror("timerfd_create");
+        return EXIT_FAILURE;
+    }
+    struct itimerspec spec = {};
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) < 0) {
+        perror("timerfd_settime");
+        close(timer_fd);
+        return EXIT_FAILURE;
+    }
+    int pid_fd = syscall(SYS_pidfd_open, pid, 0);
+
+    print_header(cout, "Time", extra);
+    size_t n_columns = 4 + (max_order - CONT_LOWEST + 1) + (extra.empty() ? 0 : count(extra.begin(), extra.end(), ',') + 1);
+    for (;;) {
+        double elapsed;
+        if (!process_elapsed(pid, elapsed)) {
+            break;
+        }
+        ostringstream row;
+        if (!sample(row, elapsed)) {
+            // A sample can fail because the process exited mid-scan
+            if (kill(pid, 0) < 0) break;
+            // Otherwise the row is kept with empty fields, so gaps in the series are visible
+            cerr << "Sample at " << fixed << setprecision(3) << elapsed << "s failed, pid " << pid << " still running\n";
+            cout << fixed << setprecision(3) << elapsed << string(n_columns, ',') << endl;
+        }
+        else {
+            cout << fixed << setprecision(3) << elapsed << "," << row.str() << endl;
+        }
+
+        // Wait for the next tick or the process exiting
+        struct pollfd fds[2] = {{timer_fd, POLLIN, 0}, {pid_fd, POLLIN, 0}};
+        if (poll(fds, pid_fd >= 0 ? 2 : 1, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (pid_fd >= 0 && (fds[1].revents & POLLIN)) {
+            break;
+        }
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+            perror("read timerfd");
+            break;
+        }
+    }
+
+    if (pid_fd >= 0) close(pid_fd);
+    close(timer_fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,195 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include "pmap.h"
+
+using namespace std;
+
+// Differences between two snapshots
+//  - remapped: pages mapped in both, to different frames
+//  - mapped/unmapped: pages only mapped in the new/old snapshot
+//  - split: old runs whose unchanged pages now belong to more than one run
+//  - merged: new runs whose unchanged pages came from more than one old run
+struct DiffStats {
+    u64 remapped = 0;
+    u64 mapped = 0;
+    u64 unmapped = 0;
+    u64 split = 0;
+    u64 merged = 0;
+};
+
+static DiffStats diff_runs(const vector<SnapshotRun> &old_runs, const vector<SnapshotRun> &new_runs) {
+    DiffStats stats;
+
+    // Same-mapping overlaps seen by the current old and new run
+    size_t last_old = SIZE_MAX, last_new = SIZE_MAX;
+    u64 old_matches = 0, new_matches = 0;
+    auto finish_old = [&]() { if (old_matches > 1) stats.split++; };
+    auto finish_new = [&]() { if (new_matches > 1) stats.merged++; };
+
+    sweep_runs(old_runs, new_runs,
+        [&](size_t, u64, u64, u64 len) { stats.unmapped += len; },
+        [&](size_t, u64, u64, u64 len) { stats.mapped += len; },
+        [&](size_t io, size_t in, u64, u64 pfn_old, u64 pfn_new, u64 len) {
+            if (pfn_old != pfn_new) {
+                stats.remapped += len;
+                return;
+            }
+            if (io != last_old) {
+                finish_old();
+                last_old = io;
+                old_matches = 0;
+            }
+            if (in != last_new) {
+                finish_new();
+                last_new = in;
+                new_matches = 0;
+            }
+            old_matches++;
+            new_matches++;
+        });
+    finish_old();
+    finish_new();
+    return stats;
+}
+
+// Lay new_runs over the last known mapping of every page, as check_ptables.py does
+//  - Returns the pages of new_runs whose frame differs from their last known frame
+//  - Pages not in new_runs keep their last known frame
+static u64 overlay_known(vector<SnapshotRun> &known, const vector<SnapshotRun> &new_runs) {
+    u64 changed = 0;
+    vector<SnapshotRun> merged;
+    merged.reserve(known.size() + new_runs.size());
+    auto append = [&](u64 vpn, u64 pfn, u64 len) {
+        if (!merged.empty()) {
+            SnapshotRun &last = merged.back();
+            if (last.VPN + last.length == vpn && last.PFN + last.length == pfn) {
+                last.length += len;
+                return;
+            }
+        }
+        merged.push_back({vpn, pfn, len});
+    };
+    sweep_runs(known, new_runs,
+        [&](size_t, u64 vpn, u64 pfn, u64 len) { append(vpn, pfn, len); },
+        [&](size_t, u64 vpn, u64 pfn, u64 len) { append(vpn, pfn, len); },
+        [&](size_t, size_t, u64 vpn, u64 pfn_old, u64 pfn_new, u64 len) {
+            if (pfn_old != pfn_new) changed += len;
+            append(vpn, pfn_new, len);
+        });
+    known.swap(merged);
+    return changed;
+}
+
+static void print_stats(const DiffStats &stats) {
+    cout << "Pages remapped:   " << stats.remapped << "\n";
+    cout << "Pages mapped:     " << stats.mapped << "\n";
+    cout << "Pages unmapped:   " << stats.unmapped << "\n";
+    cout << "Runs split:       " << stats.split << "\n";
+    cout << "Runs merged:      " << stats.merged << "\n";
+}
+
+// Time of a pagemap_<time>[.txt|.csv|.bin] snapshot, -1 if the name does not match
+//  - Sidecars dump_pagemap writes next to a snapshot (.vmas, .numa, .lifetimes) are not snapshots
+static long snapshot_time(const string &name) {
+    if (name.rfind("pagemap_", 0) != 0) return -1;
+    string rest = name.substr(8);
+    size_t dot = rest.find('.');
+    string digits = rest.substr(0, dot);
+    string ext = dot == string::npos ? "" : rest.substr(dot);
+    if (digits.empty() || digits.find_first_not_of("0123456789") != string::npos ||
+            (ext != "" && ext != ".txt" && ext != ".csv" && ext != ".bin")) {
+        return -1;
+    }
+    try {
+        size_t used;
+        long time = stol(digits, &used);
+        return used == digits.size() ? time : -1;
+    } catch (const exception &) {
+        return -1;
+    }
+}
+
+// The pagemap_<time> snapshots in dir, in time order
+static bool list_snapshots(const string &dir, vector<pair<long, string>> &files) {
+    if (!filesystem::is_directory(dir)) {
+        cerr << "Error: " << dir << " is not a valid directory\n";
+        return false;
+    }
+    for (const auto &entry : filesystem::directory_iterator(dir)) {
+        long time = snapshot_time(entry.path().filename().string());
+        if (time >= 0) {
+            files.push_back({time, entry.path().string()});
+        }
+    }
+    sort(files.begin(), files.end());
+    return true;
+}
+
+// Compares contiguous-region snapshots written by dump_pagemap (text or --binary)
+// - diff_pagemap <old> <new>: differences between two snapshots
+// - diff_pagemap <dir>: streams over the pagemap_<time> snapshots in dir in time order, one CSV row
+//   per snapshot against the previous one, then the total number of page mappings changed
+// - diff_pagemap --lifetimes <dir>: streams over the same snapshots tracking how long each run
+//   survives, in the time unit of the file names, and prints survival by run order (see lifetimes.cpp)
+int main(int argc, char **argv)
+{
+    if (argc != 2 && argc != 3) {
+        cerr << "Usage: " << argv[0] << " <old_snapshot> <new_snapshot>\n";
+        cerr << "       " << argv[0] << " [--lifetimes] <snapshot_dir>\n";
+        return EXIT_FAILURE;
+    }
+
+    if (argc == 3 && string(argv[1]) == "--lifetimes") {
+        vector<pair<long, string>> files;
+        if (!list_snapshots(argv[2], files)) {
+            return EXIT_FAILURE;
+        }
+        // Only the live runs are kept between snapshots
+        RunTracker tracker;
+        vector<SnapshotRun> cur;
+        for (const auto &file : files) {
+            if (!load_runs(file.second, cur)) {
+                return EXIT_FAILURE;
+            }
+            tracker.update(cur, file.first);
+        }
+        tracker.write(cout);
+        return EXIT_SUCCESS;
+    }
+
+    if (argc == 3) {
+        vector<SnapshotRun> old_runs, new_runs;
+        if (!load_runs(argv[1], old_runs) || !load_runs(argv[2], new_runs)) {
+            return EXIT_FAILURE;
+        }
+        print_stats(diff_runs(old_runs, new_runs));
+        return EXIT_SUCCESS;
+    }
+
+    // Snapshots in time order
+    vector<pair<long, string>> files;
+    if (!list_snapshots(argv[1], files)) {
+        return EXIT_FAILURE;
+    }
+
+    // Only the previous snapshot and the last known mapping of each page are kept
+    vector<SnapshotRun> prev, cur, known;
+    u64 total_changed = 0;
+    cout << "Time,Remapped,Mapped,Unmapped,Split,Merged,Changed\n";
+    for (size_t f = 0; f < files.size(); f++) {
+        if (!load_runs(files[f].second, cur)) {
+            return EXIT_FAILURE;
+        }
+        DiffStats stats = diff_runs(prev, cur);
+        u64 changed = overlay_known(known, cur);
+        total_changed += changed;
+        cout << files[f].first << "," << stats.remapped << "," << stats.mapped << "," << stats.unmapped << ","
+             << stats.split << "," << stats.merged << "," << changed << "\n";
+        prev.swap(cur);
+    }
+    cout << "Page Mappings Changed: " << total_changed << endl;
+    return EXIT_SUCCESS;
+}
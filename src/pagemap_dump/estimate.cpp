@@ -0,0 +1,166 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+
+#include "pmap.h"
+
+using namespace std;
+
+// Run found around a probe, clipped to the power-of-2 window of its frames
+struct ProbedRun {
+    u64 first_VPN;
+    u64 end_VPN;
+    u64 first_PFN;
+};
+
+// Pagemap reads of a single estimate
+struct ProbeReader {
+    int pagemap_fd;
+    size_t page_size;
+    vector<uint64_t> buf;
+    u64 pages_read = 0;
+
+    bool read(u64 VPN, size_t n) {
+        pages_read += n;
+        return pagemap_read_range(buf.data(), VPN * page_size, n, pagemap_fd) == (ssize_t) n;
+    }
+};
+
+static inline bool maps(uint64_t entry, u64 PFN) {
+    return PM_PRESENT(entry) && PM_PFN(entry) != 0 && PM_PFN(entry) == PFN;
+}
+
+// =================================================================================================
+// Find the run holding page VPN, mapped to frame PFN, within [lo, hi)
+//  - The order of the page holding PFN only depends on the run inside the 2^max_order frame window
+//    of PFN (see pow2_window). The walk stops at the window, which bounds the cost of a probe to
+//    2^max_order entries.
+//  - Entries are read outward in blocks doubling from 64 entries. In hugetlb regions a huge page is
+//    mapped as a whole, only the first entry of each huge page is read.
+// =================================================================================================
+static bool walk_run(ProbeReader &reader, u64 VPN, u64 PFN, u64 lo, u64 hi, u64 huge_pages, ProbedRun &run) {
+    pow2_window(VPN, PFN, max_order, lo, hi);
+    // Frame VPN x maps to if it continues the run
+    auto expected = [&](u64 x) { return PFN + x - VPN; };
+
+    u64 first = VPN, end = VPN + 1;
+    if (huge_pages > 1) {
+        first = max(lo, VPN - VPN % huge_pages);
+        end = min(hi, VPN - VPN % huge_pages + huge_pages);
+        while (first > lo) {
+            u64 x = first - lo > huge_pages ? first - huge_pages : lo;
+            if (!reader.read(x, 1)) return false;
+            if (!maps(reader.buf[0], expected(x))) break;
+            first = x;
+        }
+        while (end < hi) {
+            if (!reader.read(end, 1)) return false;
+            if (!maps(reader.buf[0], expected(end))) break;
+            end = min(hi, end + huge_pages);
+        }
+    }
+    else {
+        bool open = true;
+        for (size_t block = 64; open && first > lo; block = min(block * 2, (size_t) PAGEMAP_CHUNK_PAGES)) {
+            size_t n = min((u64) block, first - lo);
+            if (!reader.read(first - n, n)) return false;
+            size_t i = n;
+            while (i > 0 && maps(reader.buf[i - 1], expected(first - n + i - 1))) i--;
+            open = i == 0;
+            first -= n - i;
+        }
+        open = true;
+        for (size_t block = 64; open && end < hi; block = min(block * 2, (size_t) PAGEMAP_CHUNK_PAGES)) {
+            size_t n = min((u64) block, hi - end);
+            if (!reader.read(end, n)) return false;
+            size_t i = 0;
+            while (i < n && maps(reader.buf[i], expected(end + i))) i++;
+            open = i == n;
+            end += i;
+        }
+    }
+    run = {first, end, expected(first)};
+    return true;
+}
+
+// =================================================================================================
+// Estimate the power-of-2 breakdown of the given regions from n_probes random virtual pages
+//  - Probes are uniform over the pages of the regions. The probe hits a page of order k with
+//    probability (pages in pages of order k) / (pages of the regions), so the share of probes per
+//    order estimates how much memory each order covers without bias. A page of order k is 2^k
+//    times as likely to be hit as a 4K page, dividing the covered pages by 2^k corrects for that
+//    length bias and estimates the number of pages of each order.
+//  - Probes are visited in VPN order, a probe inside the last run found reuses it
+//  - The cost is n_probes walks of at most 2^max_order entries, independent of the RSS
+// =================================================================================================
+bool estimate_regions(const vector<MemoryRegion> &regions, int pagemap_fd, u64 n_probes, u64 seed, ContiguityEstimate &estimate) {
+    ProbeReader reader = {pagemap_fd, (size_t) sysconf(_SC_PAGE_SIZE), vector<uint64_t>(PAGEMAP_CHUNK_PAGES)};
+
+    // First page of each region in the concatenated page space
+    vector<u64> region_offsets;
+    u64 total_pages = 0;
+    for (const auto &region : regions) {
+        region_offsets.push_back(total_pages);
+        total_pages += region.size / reader.page_size;
+    }
+    estimate.n_probes = n_probes;
+    estimate.virtual_pages = total_pages;
+    if (total_pages == 0) {
+        return true;
+    }
+
+    mt19937_64 rng(seed);
+    uniform_int_distribution<u64> page(0, total_pages - 1);
+    vector<u64> probes(n_probes);
+    for (auto &probe : probes) probe = page(rng);
+    sort(probes.begin(), probes.end());
+
+    ProbedRun run = {0, 0, 0};
+    size_t r = 0;
+    for (u64 probe : probes) {
+        while (r + 1 < regions.size() && region_offsets[r + 1] <= probe) r++;
+        u64 lo = regions[r].address / reader.page_size;
+        u64 hi = lo + regions[r].size / reader.page_size;
+        u64 VPN = lo + probe - region_offsets[r];
+
+        if (VPN < run.first_VPN || VPN >= run.end_VPN) {
+            if (!reader.read(VPN, 1)) {
+                return false;
+            }
+            uint64_t entry = reader.buf[0];
+            if (!PM_PRESENT(entry) || PM_PFN(entry) == 0) {
+                continue;
+            }
+            u64 huge_pages = max(regions[r].kernel_page_size / reader.page_size, (size_t) 1);
+            if (!walk_run(reader, VPN, PM_PFN(entry), lo, hi, huge_pages, run)) {
+                return false;
+            }
+        }
+        estimate.mapped_hits++;
+        u64 PFN = run.first_PFN + VPN - run.first_VPN;
+        int order = pow2_order_at(run.first_PFN, run.first_PFN + run.end_VPN - run.first_VPN, run.first_VPN, PFN,
+                                  require_alignment, max_order);
+        if (order >= 0) {
+            estimate.order_hits[order - CONT_LOWEST]++;
+        }
+    }
+    estimate.pages_read = reader.pages_read;
+    return true;
+}
+
+// 95% Wilson score interval of the proportion hits / n
+void wilson_interval(u64 hits, u64 n, double &low, double &high) {
+    if (n == 0) {
+        low = high = 0;
+        return;
+    }
+    const double z = 1.96;
+    double p = double(hits) / n;
+    double denom = 1 + z * z / n;
+    double center = (p + z * z / (2 * n)) / denom;
+    double half = z * sqrt(p * (1 - p) / n + z * z / (4.0 * n * n)) / denom;
+    low = max(0.0, center - half);
+    high = min(1.0, center + half);
+}
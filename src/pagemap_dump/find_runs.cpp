@@ -0,0 +1,139 @@
+#include <immintrin.h>
+#include "pmap.h"
+
+using namespace std;
+
+// =================================================================================================
+// Run detection over a buffer of raw pagemap entries
+//  - A page is mapped when it is present with a non-zero PFN, a run is a maximal stretch of mapped
+//    pages whose PFNs increase by one
+//  - The scalar kernel is a loop over the entries, extending the last run or starting a new one
+//  - The AVX2 kernel works on 64 entries at a time: a break mask, built 4 entries at a time, holds a
+//    bit for every entry that does not continue the entry before it, and only the set bits are
+//    visited. Runs are closed at a break and opened when the entry at the break is mapped, so
+//    contiguous memory costs a few instructions per 64 pages and fragmented memory one iteration
+//    per page. The remaining entries (fewer than 64) are visited one at a time.
+//  - runs must have room for one run more than n, the open run is written out at every break
+//  - get_run_finder picks the AVX2 kernel when the CPU has it, it beats the loop on every input
+//    shape of runs_bench, by the most on long runs
+// =================================================================================================
+
+// Run open at the end of the previous block
+struct RunState {
+    bool open = false;
+    size_t start = 0;
+    uint64_t PFN = 0;
+    size_t count = 0;
+    PagemapRun *runs;
+};
+
+// Visit the breaks of the block of 64 entries at base, mapped has a bit per mapped entry
+//  - The open run is written out at every break and only counted if it was open, so fragmented
+//    memory does not pay for a mispredicted branch per page
+static inline void visit_breaks(const uint64_t *entries, size_t base, uint64_t breaks, uint64_t mapped, RunState &state) {
+    while (breaks) {
+        int bit = __builtin_ctzll(breaks);
+        breaks &= breaks - 1;
+        size_t i = base + bit;
+        state.runs[state.count] = {state.start, i - state.start, state.PFN};
+        state.count += state.open;
+        state.open = (mapped >> bit) & 1;
+        state.start = i;
+        state.PFN = PM_PFN(entries[i]);
+    }
+}
+
+static inline size_t finish_runs(size_t n, RunState &state) {
+    if (state.open) {
+        state.runs[state.count++] = {state.start, n - state.start, state.PFN};
+    }
+    return state.count;
+}
+
+// Break and mapped bits of the entries of [base, end), bit i for entry base + i, for the tail of the
+// AVX2 kernel
+//  - An entry breaks when it does not continue entry base + i - 1
+static inline void scalar_masks(const uint64_t *entries, size_t base, size_t end, uint64_t &breaks, uint64_t &mapped) {
+    breaks = 0;
+    mapped = 0;
+    bool prev_mapped = base > 0 && PM_PRESENT(entries[base - 1]) && PM_PFN(entries[base - 1]) != 0;
+    u64 prev_PFN = base > 0 ? PM_PFN(entries[base - 1]) : 0;
+    for (size_t i = base; i < end; i++) {
+        u64 PFN = PM_PFN(entries[i]);
+        bool cur_mapped = PM_PRESENT(entries[i]) && PFN != 0;
+        bool cont = cur_mapped && prev_mapped && PFN == prev_PFN + 1;
+        breaks |= (uint64_t) !cont << (i - base);
+        mapped |= (uint64_t) cur_mapped << (i - base);
+        prev_mapped = cur_mapped;
+        prev_PFN = PFN;
+    }
+}
+
+size_t find_runs_scalar(const uint64_t *entries, size_t n, PagemapRun *runs) {
+    size_t n_runs = 0;
+    u64 last_PFN = 0;
+    for (size_t i = 0; i < n; i++) {
+        u64 PFN = PM_PRESENT(entries[i]) ? PM_PFN(entries[i]) : 0;
+        if (PFN == 0) {
+            last_PFN = 0;
+            continue;
+        }
+        if (last_PFN != 0 && PFN == last_PFN + 1) {
+            runs[n_runs - 1].length++;
+        }
+        else {
+            runs[n_runs++] = {i, 1, PFN};
+        }
+        last_PFN = PFN;
+    }
+    return n_runs;
+}
+
+// Break and mapped bits of the 4 entries of cur, prev holds the entries before them
+__attribute__((target("avx2")))
+static inline void avx2_masks(__m256i cur, __m256i prev, uint64_t &breaks, uint64_t &mapped) {
+    const __m256i pfn_mask = _mm256_set1_epi64x(((uint64_t) 1 << 55) - 1);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i pfn_cur = _mm256_and_si256(cur, pfn_mask);
+    __m256i pfn_prev = _mm256_and_si256(prev, pfn_mask);
+    // Present is the sign bit, an entry is mapped when it is negative with a non-zero PFN
+    __m256i mapped_cur = _mm256_andnot_si256(_mm256_cmpeq_epi64(pfn_cur, zero), _mm256_cmpgt_epi64(zero, cur));
+    __m256i mapped_prev = _mm256_andnot_si256(_mm256_cmpeq_epi64(pfn_prev, zero), _mm256_cmpgt_epi64(zero, prev));
+    __m256i next = _mm256_cmpeq_epi64(pfn_cur, _mm256_add_epi64(pfn_prev, _mm256_set1_epi64x(1)));
+    __m256i cont = _mm256_and_si256(_mm256_and_si256(mapped_cur, mapped_prev), next);
+    breaks = ~_mm256_movemask_pd(_mm256_castsi256_pd(cont)) & 0xf;
+    mapped = _mm256_movemask_pd(_mm256_castsi256_pd(mapped_cur));
+}
+
+__attribute__((target("avx2")))
+size_t find_runs_avx2(const uint64_t *entries, size_t n, PagemapRun *runs) {
+    RunState state;
+    state.runs = runs;
+    size_t base = 0;
+    for (; base + 64 <= n; base += 64) {
+        uint64_t breaks = 0, mapped = 0;
+        for (size_t i = 0; i < 64; i += 4) {
+            __m256i cur = _mm256_loadu_si256((const __m256i *) (entries + base + i));
+            // The first entry has no previous entry, a zero entry makes it break
+            __m256i prev = base + i == 0 ? _mm256_setr_epi64x(0, entries[0], entries[1], entries[2])
+                                         : _mm256_loadu_si256((const __m256i *) (entries + base + i - 1));
+            uint64_t b, m;
+            avx2_masks(cur, prev, b, m);
+            breaks |= b << i;
+            mapped |= m << i;
+        }
+        visit_breaks(entries, base, breaks, mapped, state);
+    }
+    if (base < n) {
+        uint64_t breaks, mapped;
+        scalar_masks(entries, base, n, breaks, mapped);
+        visit_breaks(entries, base, breaks, mapped, state);
+    }
+    return finish_runs(n, state);
+}
+
+// Fastest kernel the CPU supports, chosen on the first call
+pagemap_run_finder get_run_finder() {
+    static pagemap_run_finder finder = __builtin_cpu_supports("avx2") ? find_runs_avx2 : find_runs_scalar;
+    return finder;
+}
@@ -0,0 +1,141 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+
+#include "pmap.h"
+
+using namespace std;
+
+// Order of a run, floor(log2(length))
+static int run_order(u64 length) {
+    return min(63 - __builtin_clzll(length), CONT_MAX_ORDER);
+}
+
+// Bucket of a lifetime, 0 for less than 1 time unit, i for [2^(i-1), 2^i)
+static int lifetime_bucket(double lifetime) {
+    int bucket = 0;
+    while (bucket < LIFETIME_BUCKETS - 1 && lifetime >= (double) ((u64) 1 << bucket)) bucket++;
+    return bucket;
+}
+
+void RunTracker::death(const LiveRun &run, double time) {
+    if (run.initial) return;
+    int order = run_order(run.length);
+    died[order]++;
+    deaths[order][lifetime_bucket(time - run.birth)]++;
+    total_lifetime[order] += time - run.birth;
+}
+
+ScanRunsByVPN::ScanRunsByVPN(const ScanResult &scan) : scan(scan) {
+    vector<pair<size_t, size_t>> slices;  // (first run, end) of each region with runs
+    for (size_t r = 0; r + 1 < scan.region_first_run.size(); r++) {
+        if (scan.region_first_run[r] < scan.region_first_run[r + 1]) {
+            slices.push_back({scan.region_first_run[r], scan.region_first_run[r + 1]});
+        }
+    }
+    sort(slices.begin(), slices.end(), [&](const pair<size_t, size_t> &a, const pair<size_t, size_t> &b) {
+        return scan.region_starts_V[a.first] < scan.region_starts_V[b.first];
+    });
+    for (const auto &slice : slices) {
+        slice_start.push_back(n_runs);
+        slice_first_run.push_back(slice.first);
+        n_runs += slice.second - slice.first;
+    }
+    slice_start.push_back(n_runs);
+}
+
+// =================================================================================================
+// Update the live runs with the runs of the next snapshot, taken at time
+//  - A run lives while a run with the same VPN, PFN and length is in every snapshot. A run that
+//    grows, shrinks or moves dies, and the run replacing it is born.
+//  - Live runs and the snapshot are walked together by sweep_runs. An unchanged run is a single
+//    stretch mapped by both with the same bounds and frame, and is carried over as is. Statistics
+//    are only updated for the runs that were born or died.
+//  - The snapshot is read in place, the live runs are rewritten in one pass
+//  - Runs of the first snapshot have no known birth, they are tracked but left out of the
+//    statistics (counted in initial)
+// =================================================================================================
+template <typename Runs>
+void RunTracker::update_runs(const Runs &runs, double time) {
+    if (first) {
+        first_time = time;
+    }
+    last_time = time;
+    vector<LiveRun> next;
+    next.reserve(runs.size());
+    size_t last_died = SIZE_MAX, last_born = SIZE_MAX;
+    auto died_at = [&](size_t il) {
+        if (il != last_died) {
+            death(live[il], time);
+            last_died = il;
+        }
+    };
+    auto born_at = [&](size_t in) {
+        if (in != last_born) {
+            SnapshotRun run = runs[in];
+            next.push_back({run.VPN, run.PFN, run.length, time, first});
+            (first ? initial : born)[run_order(run.length)]++;
+            last_born = in;
+        }
+    };
+    sweep_runs(live, runs,
+        [&](size_t il, u64, u64, u64) { died_at(il); },
+        [&](size_t in, u64, u64, u64) { born_at(in); },
+        [&](size_t il, size_t in, u64 vpn, u64 pfn_live, u64 pfn_new, u64 len) {
+            const LiveRun &run = live[il];
+            if (vpn == run.VPN && len == run.length && pfn_live == pfn_new && vpn == runs[in].VPN && len == runs[in].length) {
+                next.push_back(run);
+                return;
+            }
+            died_at(il);
+            born_at(in);
+        });
+    live.swap(next);
+    first = false;
+}
+
+void RunTracker::update(const vector<SnapshotRun> &runs, double time) {
+    update_runs(runs, time);
+}
+
+void RunTracker::update(const ScanResult &scan, double time) {
+    update_runs(ScanRunsByVPN(scan), time);
+}
+
+// =================================================================================================
+// Survival by run order, one CSV row per order with runs
+//  - Born: runs born after the first snapshot, Born-Rate: per time unit over the tracked span
+//  - Died: those of them that died, by lifetime in time units: "<1" for less than 1, "<2" for
+//    [1, 2), "<4" for [2, 4), ... Mean-Lifetime is over the runs that died
+//  - Alive: runs born after the first snapshot still alive, Initial: runs of the first snapshot
+// =================================================================================================
+void RunTracker::write(ostream &out) const {
+    // Lifetime columns up to the longest lifetime seen
+    int n_buckets = 1;
+    for (int order = 0; order <= CONT_MAX_ORDER; order++) {
+        for (int b = 0; b < LIFETIME_BUCKETS; b++) {
+            if (deaths[order][b] > 0) n_buckets = max(n_buckets, b + 1);
+        }
+    }
+    vector<u64> alive(CONT_MAX_ORDER + 1, 0);
+    for (const auto &run : live) {
+        if (!run.initial) alive[run_order(run.length)]++;
+    }
+
+    out << "Order,Born,Born-Rate,Died,Mean-Lifetime,Alive,Initial";
+    for (int b = 0; b < n_buckets; b++) {
+        out << ",<" << ((u64) 1 << b);
+    }
+    out << "\n" << fixed << setprecision(3);
+    double span = last_time - first_time;
+    for (int order = 0; order <= CONT_MAX_ORDER; order++) {
+        if (born[order] == 0 && initial[order] == 0) continue;
+        out << order_name(order) << "," << born[order] << "," << (span > 0 ? born[order] / span : 0) << "," << died[order]
+            << "," << (died[order] ? total_lifetime[order] / died[order] : 0) << "," << alive[order] << "," << initial[order];
+        for (int b = 0; b < n_buckets; b++) {
+            out << "," << deaths[order][b];
+        }
+        out << "\n";
+    }
+}
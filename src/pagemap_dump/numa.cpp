@@ -0,0 +1,105 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+
+#include "pmap.h"
+
+using namespace std;
+
+// =================================================================================================
+// Physical memory of the NUMA nodes
+//  - Every memory block linked from /sys/devices/system/node/node<N>/memory<M> covers the PFNs
+//    [M * block_pages, (M + 1) * block_pages), with the block size from
+//    /sys/devices/system/memory/block_size_bytes
+//  - Adjacent blocks of the same node are merged into one range, ranges are sorted by PFN so the
+//    node of a PFN is a binary search
+// =================================================================================================
+bool NodeMap::load() {
+    const string node_dir = "/sys/devices/system/node";
+    ifstream block_size_file("/sys/devices/system/memory/block_size_bytes");
+    u64 block_size;
+    if (!(block_size_file >> hex >> block_size) || block_size < (u64) sysconf(_SC_PAGE_SIZE)) {
+        cerr << "Failed to read the memory block size\n";
+        return false;
+    }
+    u64 block_pages = block_size / sysconf(_SC_PAGE_SIZE);
+
+    error_code ec;
+    for (const auto &node_entry : filesystem::directory_iterator(node_dir, ec)) {
+        string node_name = node_entry.path().filename().string();
+        if (node_name.rfind("node", 0) != 0 || node_name.size() == 4 || !isdigit(node_name[4])) {
+            continue;
+        }
+        int node = stoi(node_name.substr(4));
+        for (const auto &entry : filesystem::directory_iterator(node_entry.path(), ec)) {
+            string name = entry.path().filename().string();
+            if (name.rfind("memory", 0) != 0 || name.size() == 6 || !isdigit(name[6])) {
+                continue;
+            }
+            u64 block = stoull(name.substr(6));
+            ranges.push_back({block * block_pages, (block + 1) * block_pages, node});
+        }
+        max_node = max(max_node, node);
+    }
+    if (ranges.empty()) {
+        cerr << "No memory blocks found in " << node_dir << "\n";
+        return false;
+    }
+
+    sort(ranges.begin(), ranges.end(), [](const Range &a, const Range &b) { return a.start < b.start; });
+    vector<Range> merged;
+    for (const auto &range : ranges) {
+        if (!merged.empty() && merged.back().end == range.start && merged.back().node == range.node) {
+            merged.back().end = range.end;
+        } else {
+            merged.push_back(range);
+        }
+    }
+    ranges.swap(merged);
+    return true;
+}
+
+// Node of pfn, -1 if no node holds it. end is set to the first PFN after pfn that may be on another node.
+int NodeMap::node_of(u64 pfn, u64 &end) const {
+    auto it = upper_bound(ranges.begin(), ranges.end(), pfn, [](u64 p, const Range &r) { return p < r.start; });
+    if (it != ranges.begin() && pfn < prev(it)->end) {
+        end = prev(it)->end;
+        return prev(it)->node;
+    }
+    end = it == ranges.end() ? ~(u64) 0 : it->start;
+    return -1;
+}
+
+// =================================================================================================
+// Split the runs of a scan by the node backing them and count each node's power-of-2 regions
+//  - A run crossing a node boundary cannot be coalesced across it, each piece is counted on its
+//    own node. Pieces keep their virtual offset, so aligned counting still applies.
+//  - Pages outside every node are counted in the last slot
+// =================================================================================================
+void count_by_node(const ScanResult &scan, const NodeMap &nodes, NodeBreakdown &breakdown) {
+    size_t n_slots = nodes.n_nodes() + 1;
+    breakdown.pages.assign(n_slots, 0);
+    breakdown.power2_regions.assign(n_slots, vector<u64>(CONT_MAX_ORDER - CONT_LOWEST + 1, 0));
+    for (size_t i = 0; i < scan.region_lengths.size(); i++) {
+        u64 start = scan.region_starts_P[i];
+        u64 end = start + scan.region_lengths[i];
+        u64 v_start = scan.region_starts_V[i];
+        while (start < end) {
+            u64 node_end;
+            int node = nodes.node_of(start, node_end);
+            u64 piece_end = min(end, node_end);
+            size_t slot = node < 0 ? n_slots - 1 : node;
+            breakdown.pages[slot] += piece_end - start;
+            if (require_alignment) {
+                count_pow2_aligned(start, piece_end, v_start, max_order, breakdown.power2_regions[slot].data());
+            } else {
+                count_pow2(start, piece_end, max_order, breakdown.power2_regions[slot].data());
+            }
+            v_start += piece_end - start;
+            start = piece_end;
+        }
+    }
+}
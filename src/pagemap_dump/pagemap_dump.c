@@ -10,6 +10,36 @@
 
 #include "pmap.h"
 
+/* Page size is fixed for the lifetime of the process, don't ask the kernel for every page */
+static size_t page_size(void)
+{
+    static size_t size = 0;
+    if (!size) size = sysconf(_SC_PAGE_SIZE);
+    return size;
+}
+
+/* Read n 64-bit entries, starting at entry index, of a /proc file indexed by page (pagemap, kpageflags, ...).
+ *
+ * @return number of entries read, -1 for failure
+ */
+static ssize_t read_entries(uint64_t *buf, uint64_t index, size_t n, int fd)
+{
+    size_t nread = 0;
+    size_t nbytes = n * sizeof(uint64_t);
+    off_t offset = index * sizeof(uint64_t);
+    while (nread < nbytes) {
+        ssize_t ret = pread(fd, ((uint8_t*)buf) + nread, nbytes - nread, offset + nread);
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        nread += ret;
+    }
+    return nread / sizeof(uint64_t);
+}
+
 /* Parse the pagemap entry for the given virtual address.
  *
  * @param[out] entry      the parsed entry
@@ -26,7 +56,7 @@ int pagemap_get_entry(PagemapEntry *entry, uintptr_t vaddr, int pagemap_fd, int
     nread = 0;
     while (nread < sizeof(data)) {
         ret = pread(pagemap_fd, ((uint8_t*)&data) + nread, sizeof(data) - nread,
-                (vaddr / sysconf(_SC_PAGE_SIZE)) * sizeof(data) + nread);
+                (vaddr / page_size()) * sizeof(data) + nread);
         nread += ret;
         if (ret <= 0) {
             return 1;
@@ -40,20 +70,95 @@ int pagemap_get_entry(PagemapEntry *entry, uintptr_t vaddr, int pagemap_fd, int
 
     // Find kpageflags entry
     uint64_t page_flags;
-    nread = 0;
-    while (nread < sizeof(page_flags)) {
-        ret = pread(kflags_fd, ((uint8_t*)&page_flags) + nread, sizeof(page_flags) - nread,
-                (entry->pfn * sizeof(page_flags)) + nread);
-        nread += ret;
-        if (ret <= 0) {
-            return 1;
-        }
+    if (kpage_read_range(&page_flags, entry->pfn, 1, kflags_fd) != 1) {
+        return 1;
     }
     entry->thp = (page_flags >> 22) & 1;
     entry->hugetlb = (page_flags >> 17) & 1;
     return 0;
 }
 
+/* Read the raw pagemap entries of n_pages consecutive virtual pages with a single pread.
+ * Entries can be decoded with the PM_* macros in pmap.h.
+ *
+ * @param[out] buf        buffer of at least n_pages entries
+ * @param[in]  vaddr      virtual address of the first page
+ * @param[in]  n_pages    number of pages to read
+ * @param[in]  pagemap_fd file descriptor to an open /proc/pid/pagemap file
+ * @return number of entries read, -1 for failure
+ */
+ssize_t pagemap_read_range(uint64_t *buf, uintptr_t vaddr, size_t n_pages, int pagemap_fd)
+{
+    return read_entries(buf, vaddr / page_size(), n_pages, pagemap_fd);
+}
+
+/* Read the entries of n_pages consecutive physical frames from /proc/kpageflags or /proc/kpagecount
+ * with a single pread. Frames without a struct page read as KPF_NOPAGE (flags) or 0 (count).
+ *
+ * @param[out] buf        buffer of at least n_pages entries
+ * @param[in]  pfn        first physical frame
+ * @param[in]  n_pages    number of frames to read
+ * @param[in]  kpage_fd   file descriptor to an open /proc/kpageflags or /proc/kpagecount file
+ * @return number of entries read, -1 for failure
+ */
+ssize_t kpage_read_range(uint64_t *buf, uint64_t pfn, size_t n_pages, int kpage_fd)
+{
+    return read_entries(buf, pfn, n_pages, kpage_fd);
+}
+
+/* Find the present pages in [start, end) with the PAGEMAP_SCAN ioctl. Absent ranges are skipped
+ * by the kernel without producing pagemap entries. Adjacent present pages are merged into one range,
+ * unless one is mapped by a huge page table entry and the other is not: ranges of PMD-mapped THPs
+ * and hugetlb pages are returned on their own, with PAGE_IS_HUGE set in categories.
+ *
+ * @param[out] vec        present ranges found, at most vec_len
+ * @param[in]  start      first virtual address to scan
+ * @param[in]  end        end of the virtual address range to scan
+ * @param[out] walk_end   address the walk stopped at, scan again from here if it is below end
+ * @param[in]  pagemap_fd file descriptor to an open /proc/pid/pagemap file
+ * @return number of ranges found, -1 for failure
+ */
+long pagemap_scan_present(struct page_region *vec, size_t vec_len, uintptr_t start, uintptr_t end, uintptr_t *walk_end, int pagemap_fd)
+{
+    struct pm_scan_arg arg = {};
+    arg.size = sizeof(arg);
+    arg.start = start;
+    arg.end = end;
+    arg.vec = (uintptr_t)vec;
+    arg.vec_len = vec_len;
+    arg.category_mask = PAGE_IS_PRESENT;
+    arg.return_mask = PAGE_IS_PRESENT | PAGE_IS_HUGE;
+
+    long ret = ioctl(pagemap_fd, PAGEMAP_SCAN, &arg);
+    if (ret < 0) {
+        return -1;
+    }
+
+    // The walk only stops early when vec is full. Some kernels report a walk_end behind the
+    // ranges already returned, so never resume before the end of the last one.
+    *walk_end = arg.walk_end;
+    if ((size_t)ret < vec_len) {
+        *walk_end = end;
+    }
+    else if (ret > 0 && vec[ret - 1].end > *walk_end) {
+        *walk_end = vec[ret - 1].end;
+    }
+    return ret;
+}
+
+/* Check whether the running kernel supports the PAGEMAP_SCAN ioctl.
+ *
+ * @param[in]  pagemap_fd file descriptor to an open /proc/pid/pagemap file
+ * @return 1 if supported, 0 otherwise
+ */
+int pagemap_scan_supported(int pagemap_fd)
+{
+    // An empty range is valid on supporting kernels, older kernels reject the ioctl itself
+    struct page_region region;
+    uintptr_t walk_end;
+    return pagemap_scan_present(&region, 1, 0, 0, &walk_end, pagemap_fd) >= 0;
+}
+
 /* Convert the given virtual address to physical using an already opened /proc/PID/pagemap file descriptor.
  *
  * @param[out] paddr      physical address
@@ -70,15 +175,15 @@ int virt_to_phys_user(uintptr_t *paddr, uintptr_t vaddr, int pagemap_fd, int kfl
 
     // Check for mapped virtual page
     if (entry.present == 1) {
-        *paddr = (entry.pfn * sysconf(_SC_PAGE_SIZE)) + (vaddr % sysconf(_SC_PAGE_SIZE));
+        *paddr = (entry.pfn * page_size()) + (vaddr % page_size());
         *paddr += entry.thp;
     }
     else {
         *paddr = 0;
     }
 
-    // Check for hugepage
-    if (entry.thp || entry.hugetlb) {
+    // Check for hugetlb page, THPs may be smaller folios mapped at any alignment
+    if (entry.hugetlb) {
         uint64_t huge_mask = (1 << 9) - 1;
         assert((entry.pfn & huge_mask) == ((vaddr >> 12) & huge_mask));
     }
@@ -173,7 +278,7 @@ int parse_all(int argc, char **argv)
                 /* Get info about all pages in this page range with pagemap. */
                 {
                     PagemapEntry entry;
-                    for (uintptr_t addr = low; addr < high; addr += sysconf(_SC_PAGE_SIZE)) {
+                    for (uintptr_t addr = low; addr < high; addr += page_size()) {
                         /* TODO always fails for the last page (vsyscall), why? pread returns 0. */
                         if (!pagemap_get_entry(&entry, addr, pagemap_fd, kflags_fd)) {
                             printf("%jx %jx %u %u %u %u %s\n",
@@ -0,0 +1,345 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include "pmap.h"
+
+using namespace std;
+
+int require_alignment = 0;
+int max_order = CONT_HIGHEST;
+
+// A zone of a NUMA node, from /proc/zoneinfo and /proc/buddyinfo
+struct Zone {
+    int node;
+    string name;
+    u64 start_pfn;
+    u64 spanned;
+    vector<u64> buddy_blocks;  // Free blocks of each order, per /proc/buddyinfo
+    int largest_free_order;    // Largest order with free blocks, -1 if none
+};
+
+// A piece of a zone scanned by a single worker, never crossing a KPAGE_CHUNK_PAGES boundary
+struct PhysChunk {
+    size_t zone_idx;
+    u64 first_PFN;
+    u64 n_pages;
+};
+
+// Physical runs of a chunk or a zone, as (first PFN, length)
+//  - Each comes in two versions, only one of which is printed (see main)
+struct PhysRuns {
+    vector<pair<u64, u64>> free_runs;                // Flagged free pages
+    vector<pair<u64, u64>> movable_runs;             // Flagged free or migratable pages
+    vector<pair<u64, u64>> estimated_runs;           // Flagged free pages and the block pages inferred after them
+    vector<pair<u64, u64>> estimated_movable_runs;   // Estimated free or migratable pages
+};
+
+static void append_run(vector<pair<u64, u64>> &runs, u64 pfn, u64 length) {
+    if (!runs.empty() && runs.back().first + runs.back().second == pfn) {
+        runs.back().second += length;
+    } else {
+        runs.push_back({pfn, length});
+    }
+}
+
+// Zones with pages, in /proc/zoneinfo order
+static bool parse_zones(vector<Zone> &zones) {
+    ifstream zoneinfo("/proc/zoneinfo");
+    if (!zoneinfo.is_open()) {
+        cerr << "Failed to open /proc/zoneinfo\n";
+        return false;
+    }
+    string line;
+    Zone zone = {-1, "", 0, 0, {}, -1};
+    while (getline(zoneinfo, line)) {
+        istringstream fields(line);
+        string key;
+        fields >> key;
+        if (key == "Node") {
+            // "Node 0, zone   Normal"
+            string zone_word;
+            fields >> zone.node;
+            fields.ignore(1);
+            fields >> zone_word >> zone.name;
+            zone.spanned = 0;
+        }
+        else if (key == "spanned") {
+            fields >> zone.spanned;
+        }
+        else if (key == "start_pfn:") {
+            fields >> zone.start_pfn;
+            if (zone.spanned > 0) {
+                zones.push_back(zone);
+            }
+        }
+    }
+    return true;
+}
+
+// Free blocks of each order of every zone, from /proc/buddyinfo, one column per order from 0 to
+// MAX_PAGE_ORDER
+static void parse_buddyinfo(vector<Zone> &zones) {
+    ifstream buddyinfo("/proc/buddyinfo");
+    string line;
+    while (getline(buddyinfo, line)) {
+        // "Node 0, zone   Normal      3231    435 ..."
+        istringstream fields(line);
+        string node_word, zone_word, name;
+        int node;
+        fields >> node_word >> node;
+        fields.ignore(1);
+        fields >> zone_word >> name;
+        vector<u64> blocks;
+        u64 count;
+        while (fields >> count) {
+            blocks.push_back(count);
+        }
+        if (blocks.empty()) {
+            continue;
+        }
+        for (auto &zone : zones) {
+            if (zone.node == node && zone.name == name) {
+                zone.buddy_blocks = blocks;
+                zone.largest_free_order = -1;
+                for (size_t order = 0; order < blocks.size(); order++) {
+                    if (blocks[order] > 0) {
+                        zone.largest_free_order = order;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// =================================================================================================
+// Find the free and movable runs of [chunk.first_PFN, chunk.first_PFN + chunk.n_pages)
+//  - Free: pages flagged KPF_BUDDY. kpageflags documents the flag on the first page of a free
+//    buddy block only, some kernels flag every page of the block. It never gives the order.
+//  - Estimated free: free pages, and the pages without flags and without mappings that follow a
+//    flagged page, up to the largest block its PFN is aligned for and the zone has free blocks of.
+//    Unmapped kernel pages (driver and other raw allocations) pass the same test, so this is an
+//    upper bound, only meant for kernels that flag block heads alone.
+//  - Movable: free pages and pages compaction could migrate, on the LRU and neither unevictable,
+//    mlocked nor hugetlb. Runs of these are what compaction could turn into free blocks.
+//  - Chunks start at multiples of KPAGE_CHUNK_PAGES, so free blocks never cross them
+//  - kpagecount is only read for chunks with unflagged pages after a free block head
+// =================================================================================================
+static bool scan_phys_chunk(const PhysChunk &chunk, int largest_free_order, int kflags_fd, int kcount_fd, vector<uint64_t> &flags,
+                            vector<uint64_t> &counts, PhysRuns &res) {
+    if (kpage_read_range(flags.data(), chunk.first_PFN, chunk.n_pages, kflags_fd) != (ssize_t) chunk.n_pages) {
+        return false;
+    }
+    bool have_counts = false;
+    u64 block_end = 0;
+    for (u64 i = 0; i < chunk.n_pages; i++) {
+        uint64_t f = flags[i];
+        u64 PFN = chunk.first_PFN + i;
+        bool free_page = KPF_SET(f, KPF_BUDDY);
+        bool estimated = free_page;
+        if (free_page) {
+            // A head ends the block before it
+            int order = min(largest_free_order, PFN ? __builtin_ctzll(PFN) : largest_free_order);
+            block_end = order >= 0 ? PFN + ((u64) 1 << order) : 0;
+        }
+        else if (f == 0 && PFN < block_end) {
+            if (!have_counts) {
+                if (kpage_read_range(counts.data(), chunk.first_PFN, chunk.n_pages, kcount_fd) != (ssize_t) chunk.n_pages) {
+                    return false;
+                }
+                have_counts = true;
+            }
+            estimated = counts[i] == 0;
+        }
+        if (!estimated) {
+            block_end = 0;
+        }
+        bool migratable = KPF_SET(f, KPF_LRU) && !KPF_SET(f, KPF_UNEVICTABLE) &&
+                          !KPF_SET(f, KPF_MLOCKED) && !KPF_SET(f, KPF_HUGE);
+        if (free_page) {
+            append_run(res.free_runs, PFN, 1);
+        }
+        if (free_page || migratable) {
+            append_run(res.movable_runs, PFN, 1);
+        }
+        if (estimated) {
+            append_run(res.estimated_runs, PFN, 1);
+        }
+        if (estimated || migratable) {
+            append_run(res.estimated_movable_runs, PFN, 1);
+        }
+    }
+    return true;
+}
+
+static u64 run_pages(const vector<pair<u64, u64>> &runs) {
+    u64 pages = 0;
+    for (const auto &run : runs) {
+        pages += run.second;
+    }
+    return pages;
+}
+
+static void print_counts(const Zone &zone, const char *type, u64 pages, const u64 *counts) {
+    cout << zone.node << "," << zone.name << "," << type << "," << pages;
+    for (int i = 0; i <= max_order - CONT_LOWEST; i++) {
+        cout << "," << counts[i];
+    }
+    cout << "\n";
+}
+
+static void print_row(const Zone &zone, const char *type, const vector<pair<u64, u64>> &runs) {
+    u64 counts[CONT_MAX_ORDER - CONT_LOWEST + 1] = {0};
+    for (const auto &run : runs) {
+        count_pow2(run.first, run.first + run.second, max_order, counts);
+    }
+    print_counts(zone, type, run_pages(runs), counts);
+}
+
+// The free blocks /proc/buddyinfo lists for the zone, as a row
+static void print_buddyinfo_row(const Zone &zone) {
+    u64 counts[CONT_MAX_ORDER - CONT_LOWEST + 1] = {0};
+    u64 pages = 0;
+    for (size_t order = 0; order < zone.buddy_blocks.size(); order++) {
+        pages += zone.buddy_blocks[order] << order;
+        if ((int) order >= CONT_LOWEST && (int) order <= max_order) {
+            counts[order - CONT_LOWEST] = zone.buddy_blocks[order];
+        }
+    }
+    print_counts(zone, "buddyinfo", pages, counts);
+}
+
+// Power-of-2 breakdown of the free and movable physical memory of every NUMA node and zone
+//  - Streams /proc/kpageflags (and /proc/kpagecount where needed) over every zone, KPAGE_CHUNK_PAGES
+//    frames per pread, split over -j workers
+//  - Prints three rows per zone: free runs, movable runs of free or migratable pages, and the free
+//    blocks of /proc/buddyinfo to check them against (its counts are per buddy block, so runs of
+//    adjacent blocks may add up to larger orders)
+//  - Free runs are exact, "free" and "movable", when the kernel flags every page of a free block.
+//    When it flags block heads only, fewer flagged pages than /proc/buddyinfo free pages, the zone
+//    gets "free_estimated" and "movable_estimated" rows instead, and the gap to /proc/buddyinfo
+//    is reported on stderr.
+int main(int argc, char **argv)
+{
+    int n_threads = 1;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc) {
+            n_threads = stoi(argv[++i]);
+            if (n_threads < 1) {
+                cerr << "Invalid number of threads: " << n_threads << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--max-order" && i + 1 < argc) {
+            max_order = stoi(argv[++i]);
+            if (max_order < CONT_LOWEST || max_order > CONT_MAX_ORDER) {
+                cerr << "Invalid max order: " << max_order << " (" << CONT_LOWEST << "-" << CONT_MAX_ORDER << ")\n";
+                return EXIT_FAILURE;
+            }
+        }
+        else {
+            cerr << "Usage: sudo " << argv[0] << " [-j threads] [--max-order N]\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    vector<Zone> zones;
+    if (!parse_zones(zones)) {
+        return EXIT_FAILURE;
+    }
+    parse_buddyinfo(zones);
+    int kflags_fd = open("/proc/kpageflags", O_RDONLY);
+    if (kflags_fd < 0) {
+        perror("open kpageflags");
+        return EXIT_FAILURE;
+    }
+    int kcount_fd = open("/proc/kpagecount", O_RDONLY);
+    if (kcount_fd < 0) {
+        perror("open kpagecount");
+        close(kflags_fd);
+        return EXIT_FAILURE;
+    }
+
+    // Split zones into chunks at multiples of KPAGE_CHUNK_PAGES
+    vector<PhysChunk> chunks;
+    for (size_t z = 0; z < zones.size(); z++) {
+        u64 end = zones[z].start_pfn + zones[z].spanned;
+        for (u64 pfn = zones[z].start_pfn; pfn < end;) {
+            u64 next = min(end, (pfn / KPAGE_CHUNK_PAGES + 1) * KPAGE_CHUNK_PAGES);
+            chunks.push_back({z, pfn, next - pfn});
+            pfn = next;
+        }
+    }
+
+    // Scan chunks, workers pull the next unscanned chunk
+    vector<PhysRuns> chunk_runs(chunks.size());
+    atomic<size_t> next_chunk(0);
+    atomic<bool> failed(false);
+    run_workers(min((size_t) n_threads, max(chunks.size(), (size_t) 1)), [&](int) {
+        vector<uint64_t> flags(KPAGE_CHUNK_PAGES), counts(KPAGE_CHUNK_PAGES);
+        size_t c;
+        while (!failed && (c = next_chunk++) < chunks.size()) {
+            if (!scan_phys_chunk(chunks[c], zones[chunks[c].zone_idx].largest_free_order, kflags_fd, kcount_fd, flags, counts, chunk_runs[c])) {
+                failed = true;
+            }
+        }
+    });
+    close(kflags_fd);
+    close(kcount_fd);
+    if (failed) {
+        cerr << "Failed to read kpageflags\n";
+        return EXIT_FAILURE;
+    }
+
+    // Concatenate the runs of each zone, merging runs that continue into the next chunk
+    vector<PhysRuns> zone_runs(zones.size());
+    for (size_t c = 0; c < chunks.size(); c++) {
+        PhysRuns &zone = zone_runs[chunks[c].zone_idx];
+        for (const auto &run : chunk_runs[c].free_runs) {
+            append_run(zone.free_runs, run.first, run.second);
+        }
+        for (const auto &run : chunk_runs[c].estimated_runs) {
+            append_run(zone.estimated_runs, run.first, run.second);
+        }
+        for (const auto &run : chunk_runs[c].movable_runs) {
+            append_run(zone.movable_runs, run.first, run.second);
+        }
+        for (const auto &run : chunk_runs[c].estimated_movable_runs) {
+            append_run(zone.estimated_movable_runs, run.first, run.second);
+        }
+        chunk_runs[c] = PhysRuns();
+    }
+
+    cout << "Node,Zone,Type,Pages";
+    for (int order = CONT_LOWEST; order <= max_order; order++) {
+        cout << "," << order_name(order);
+    }
+    cout << "\n";
+    for (size_t z = 0; z < zones.size(); z++) {
+        // Flagged pages closer to the free blocks than to the free pages of buddyinfo: heads only
+        u64 flagged = run_pages(zone_runs[z].free_runs), buddy_pages = 0, buddy_blocks = 0;
+        for (size_t order = 0; order < zones[z].buddy_blocks.size(); order++) {
+            buddy_pages += zones[z].buddy_blocks[order] << order;
+            buddy_blocks += zones[z].buddy_blocks[order];
+        }
+        if (2 * flagged >= buddy_pages + buddy_blocks) {
+            print_row(zones[z], "free", zone_runs[z].free_runs);
+            print_row(zones[z], "movable", zone_runs[z].movable_runs);
+        }
+        else {
+            u64 estimated = run_pages(zone_runs[z].estimated_runs);
+            cerr << "Node " << zones[z].node << " zone " << zones[z].name << ": only free block heads are flagged, "
+                 << estimated << " free pages estimated against " << buddy_pages << " in /proc/buddyinfo ("
+                 << (int64_t) (estimated - buddy_pages) << ")\n";
+            print_row(zones[z], "free_estimated", zone_runs[z].estimated_runs);
+            print_row(zones[z], "movable_estimated", zone_runs[z].estimated_movable_runs);
+        }
+        print_buddyinfo_row(zones[z]);
+    }
+    cout << flush;
+    return EXIT_SUCCESS;
+}
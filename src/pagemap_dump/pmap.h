@@ -11,8 +11,13 @@
 #include <sstream>
 #include <vector>
 #include <string>
+#include <map>
 #include <algorithm>
 #include <numeric>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <time.h>
 
 #define u64 unsigned long long
 
@@ -25,8 +30,69 @@ typedef struct {
     unsigned int thp : 1;
     unsigned int hugetlb : 1;
 } PagemapEntry;
+// Raw pagemap entry decoding (see Documentation/admin-guide/mm/pagemap.rst)
+#define PM_PFN(e)       ((e) & (((uint64_t)1 << 55) - 1))
+#define PM_PRESENT(e)   (((e) >> 63) & 1)
+// Pagemap entries fetched per pread in the bulk path (1 MB buffer, 512 MB of virtual memory)
+#define PAGEMAP_CHUNK_PAGES (1 << 17)
+
+// Run of mapped pages with consecutive PFNs in a buffer of pagemap entries (see find_runs.cpp)
+struct PagemapRun {
+    size_t offset;
+    size_t length;
+    uint64_t PFN;
+};
+// Finds the runs of n entries, runs must hold up to n + 1 runs, returns the number of runs
+typedef size_t (*pagemap_run_finder)(const uint64_t *entries, size_t n, PagemapRun *runs);
+size_t find_runs_scalar(const uint64_t *entries, size_t n, PagemapRun *runs);
+size_t find_runs_avx2(const uint64_t *entries, size_t n, PagemapRun *runs);
+pagemap_run_finder get_run_finder();
+
+// PAGEMAP_SCAN ioctl on /proc/pid/pagemap (Linux 6.7+), defined here for older kernel headers
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#ifndef PAGEMAP_SCAN
+#define PAGE_IS_PRESENT (1 << 3)
+#define PAGE_IS_HUGE    (1 << 6)
+struct page_region {
+    uint64_t start;
+    uint64_t end;
+    uint64_t categories;
+};
+struct pm_scan_arg {
+    uint64_t size;
+    uint64_t flags;
+    uint64_t start;
+    uint64_t end;
+    uint64_t walk_end;
+    uint64_t vec;
+    uint64_t vec_len;
+    uint64_t max_pages;
+    uint64_t category_inverted;
+    uint64_t category_mask;
+    uint64_t category_anyof_mask;
+    uint64_t return_mask;
+};
+#define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+#endif
+// Present ranges returned per PAGEMAP_SCAN call
+#define PAGEMAP_SCAN_VEC_LEN 4096
+
+// Physical frame flags from /proc/kpageflags, KPF_* bit numbers
+#include <linux/kernel-page-flags.h>
+#ifndef KPF_MLOCKED
+#define KPF_MLOCKED 33
+#endif
+#define KPF_SET(flags, bit) (((flags) >> (bit)) & 1)
+// Frames fetched per pread of /proc/kpageflags and /proc/kpagecount (2 MB buffer, 1 GB of memory)
+#define KPAGE_CHUNK_PAGES (1 << 18)
+
 int pagemap_get_entry(PagemapEntry *entry, uintptr_t vaddr, int pagemap_fd, int kflags_fd);
 int virt_to_phys_user(uintptr_t *paddr, uintptr_t vaddr, int pagemap_fd, int kflags_fd);
+ssize_t pagemap_read_range(uint64_t *buf, uintptr_t vaddr, size_t n_pages, int pagemap_fd);
+ssize_t kpage_read_range(uint64_t *buf, uint64_t pfn, size_t n_pages, int kpage_fd);
+int pagemap_scan_supported(int pagemap_fd);
+long pagemap_scan_present(struct page_region *vec, size_t vec_len, uintptr_t start, uintptr_t end, uintptr_t *walk_end, int pagemap_fd);
 int parse_all(int argc, char **argv);
 
 
@@ -35,14 +101,331 @@ struct MemoryRegion {
     size_t size;
     size_t rss;
 
+    size_t anon_huge = 0;       // AnonHugePages, only known when parsed from smaps
+    bool thp_eligible = false;  // THPeligible, only known when parsed from smaps
+    size_t kernel_page_size = 4096;  // KernelPageSize, hugetlb page size of hugetlb mappings (smaps only)
+
+    size_t index = 0;   // Position of the mapping in /proc/<pid>/maps (or the pmap listing)
+    std::string perms;  // pmap -x mode, e.g. "rw---"
+    std::string name;   // Mapped file, [heap], [stack], ... or [anon]
+
     MemoryRegion(uint64_t addr, size_t sz, size_t rs) : address(addr), size(sz), rss(rs) {}
 };
 void parsePmapOutput(std::vector<MemoryRegion> &regions, size_t &totalRSS, bool filter);
+bool parseSmaps(pid_t pid, std::vector<MemoryRegion> &regions, size_t &totalRSS, bool filter);
 std::vector<MemoryRegion> findLargestRegions(const std::vector<MemoryRegion> &regions, size_t totalRSS, float coverage, u64 max_regions);
 
 
+// Page orders counted, CONT_HIGHEST by default (1 GB with 4K pages), up to CONT_MAX_ORDER with --max-order
 #define CONT_LOWEST 0
 #define CONT_HIGHEST 18
+#define CONT_MAX_ORDER 40
 extern int require_alignment;
+extern int max_order;
 void count_pow2(u64 start, u64 end, int pow_largest, u64* region_count);
-void count_pow2_aligned(u64 start, u64 end, u64 v_start, int pow_largest, u64* region_count);
\ No newline at end of file
+void count_pow2_aligned(u64 start, u64 end, u64 v_start, int pow_largest, u64* region_count);
+
+// Counts the power-of-2 pages of n runs into region_count
+typedef void (*pow2_counter)(const u64 *starts_P, const u64 *starts_V, const u64 *lengths, size_t n, u64 *region_count);
+pow2_counter get_pow2_counter(bool aligned, int max_order);
+// Order of the power-of-2 page holding frame pfn when the run [start, end) is counted, -1 if none does
+int pow2_order_at(u64 start, u64 end, u64 v_start, u64 pfn, bool aligned, int pow_largest);
+// Clip [lo, hi) to the pages of a run through page VPN, mapped to frame pfn, that map the frames of
+// the 2^pow_largest window holding pfn
+void pow2_window(u64 VPN, u64 pfn, int pow_largest, u64 &lo, u64 &hi);
+// Size of a page of the given order as a column name, e.g. 4K, 2M, 1G
+std::string order_name(int order);
+
+
+// Run fn(worker) on n_threads workers, the calling thread acts as worker 0
+template <typename F>
+void run_workers(int n_threads, F fn) {
+    std::vector<std::thread> workers;
+    for (int t = 1; t < n_threads; t++) {
+        workers.emplace_back(fn, t);
+    }
+    fn(0);
+    for (auto &w : workers) {
+        w.join();
+    }
+}
+
+// Pages per unit of work in the region scanner (2 GB of virtual memory, a multiple of every huge page size)
+#define SCAN_CHUNK_PAGES (1 << 19)
+
+// Contiguous virtual to physical regions found by a scan, with their power-of-2 breakdown
+struct ScanResult {
+    u64 power2_regions[CONT_MAX_ORDER - CONT_LOWEST + 1] = {0};
+    u64 n_regions = 0;
+    u64 total_pages = 0;
+    std::vector<u64> region_starts_V;
+    std::vector<u64> region_lengths;
+    std::vector<u64> region_starts_P;
+    // Runs of the r-th scanned memory region are [region_first_run[r], region_first_run[r + 1])
+    std::vector<size_t> region_first_run;
+};
+
+// Limits on the cost of a sample, 0 for no limit
+struct ScanBudget {
+    double max_cpu_pct = 0;   // CPU time of dump_pagemap as a percentage of the wall time of the sample
+    double pages_per_ms = 0;  // Virtual pages walked per millisecond
+    bool enabled() const { return max_cpu_pct > 0 || pages_per_ms > 0; }
+};
+// Pages per unit of work of a budgeted scan (32 MB of virtual memory), the pacer runs between units
+#define BUDGET_CHUNK_PAGES (1 << 13)
+
+// Keeps a sample within a ScanBudget by sleeping between units of work, shared by the scan workers
+class ScanPacer {
+public:
+    explicit ScanPacer(const ScanBudget &budget);
+    // Account for n_pages walked, then sleep until the sample is back within budget
+    void throttle(u64 n_pages);
+    // Wall time and CPU time since the pacer was created
+    double span_ms() const;
+    double cpu_ms() const;
+
+private:
+    ScanBudget budget;
+    struct timespec start_wall;
+    double start_cpu_ms;
+    std::atomic<u64> pages{0};
+};
+
+// A non-null pacer splits regions into BUDGET_CHUNK_PAGES chunks and is called after each one
+bool scan_regions(const std::vector<MemoryRegion> &regions, int pagemap_fd, bool use_scan, int n_threads, ScanResult &result,
+                  ScanPacer *pacer = nullptr);
+// Power-of-2 breakdown estimated from random probes of the regions (see estimate.cpp)
+struct ContiguityEstimate {
+    u64 n_probes = 0;
+    u64 virtual_pages = 0;  // Pages of the probed regions
+    u64 mapped_hits = 0;    // Probes that hit a mapped page
+    u64 order_hits[CONT_MAX_ORDER - CONT_LOWEST + 1] = {0};  // Probes that hit a page of each order
+    u64 pages_read = 0;     // Pagemap entries read
+};
+bool estimate_regions(const std::vector<MemoryRegion> &regions, int pagemap_fd, u64 n_probes, u64 seed, ContiguityEstimate &estimate);
+// 95% confidence interval of a proportion
+void wilson_interval(u64 hits, u64 n, double &low, double &high);
+
+// Combine the scans of several processes, frames mapped more than once are counted once
+u64 merge_scans(const std::vector<const ScanResult *> &scans, int n_threads, ScanResult &result, std::vector<u64> &shared_pages);
+
+// PFN ranges of the NUMA nodes (see numa.cpp)
+class NodeMap {
+public:
+    bool load();
+    int node_of(u64 pfn, u64 &end) const;
+    // Highest node number + 1
+    size_t n_nodes() const { return max_node + 1; }
+
+private:
+    struct Range {
+        u64 start;
+        u64 end;
+        int node;
+    };
+    std::vector<Range> ranges;
+    int max_node = -1;
+};
+
+// Tracked pages and power-of-2 regions per node, the last slot holds pages outside every node
+struct NodeBreakdown {
+    std::vector<u64> pages;
+    std::vector<std::vector<u64>> power2_regions;
+};
+void count_by_node(const ScanResult &scan, const NodeMap &nodes, NodeBreakdown &breakdown);
+
+// CSV header of the sample rows, key names the first column and extra is appended after the histogram
+void print_header(std::ostream &out, const std::string &key, const std::string &extra = "");
+// Sample pid every interval_ms until it exits, sample prints one CSV row per call, extra as in print_header
+//  - sample also gets the time since pid started in seconds, the Time column of the row
+int run_daemon(pid_t pid, long interval_ms, const std::string &extra, const std::function<bool(std::ostream &, double)> &sample);
+
+// Binary snapshots of contiguous regions (see snapshot.cpp for the layout)
+#define SNAPSHOT_BLOCK_RUNS 4096
+struct SnapshotRun {
+    u64 VPN;
+    u64 PFN;
+    u64 length;
+};
+bool write_snapshot(const std::string &path, const u64 *starts_V, const u64 *starts_P, const u64 *lengths, size_t n);
+bool is_snapshot(const std::string &path);
+bool load_runs(const std::string &path, std::vector<SnapshotRun> &runs);
+
+// Memory-mapped snapshot, iterated in VPN order
+class SnapshotReader {
+public:
+    class Iterator {
+    public:
+        const SnapshotRun &operator*() const { return run; }
+        const SnapshotRun *operator->() const { return &run; }
+        Iterator &operator++();
+        bool operator!=(const Iterator &other) const { return idx != other.idx; }
+        bool operator==(const Iterator &other) const { return idx == other.idx; }
+
+    private:
+        friend class SnapshotReader;
+        Iterator(const SnapshotReader *reader, u64 idx);
+        void decode();
+
+        const SnapshotReader *reader;
+        u64 idx;
+        const uint8_t *p = nullptr;
+        SnapshotRun run = {0, 0, 0};
+    };
+
+    SnapshotReader() = default;
+    SnapshotReader(const SnapshotReader &) = delete;
+    SnapshotReader &operator=(const SnapshotReader &) = delete;
+    ~SnapshotReader();
+
+    bool open(const std::string &path);
+    u64 size() const { return n_runs; }
+    u64 total_pages() const { return n_pages; }
+    Iterator begin() const;
+    Iterator end() const;
+    Iterator seek(u64 vpn) const;
+
+private:
+    void unmap();
+
+    const uint8_t *data = nullptr;
+    size_t length = 0;
+    u64 n_runs = 0;
+    u64 n_pages = 0;
+    u64 block_runs = 1;
+    const uint8_t *blocks_end = nullptr;     // End of the block area, start of the index
+    std::vector<std::pair<u64, u64>> index;  // (first VPN, offset) per block
+};
+
+// The runs of a scan in VPN order, read in place
+//  - Runs of a region are in VPN order, regions are in scan order (by RSS), so only the regions
+//    are sorted, by their first run
+//  - Runs are meant to be read in order, as sweep_runs does: the slice of the last run read is
+//    checked first, other runs are found by bisecting the slices
+class ScanRunsByVPN {
+public:
+    explicit ScanRunsByVPN(const ScanResult &scan);
+    size_t size() const { return n_runs; }
+    SnapshotRun operator[](size_t i) const {
+        if (i < slice_start[cur] || i >= slice_start[cur + 1]) {
+            cur = std::upper_bound(slice_start.begin(), slice_start.end(), i) - slice_start.begin() - 1;
+        }
+        size_t run = slice_first_run[cur] + (i - slice_start[cur]);
+        return {scan.region_starts_V[run], scan.region_starts_P[run], scan.region_lengths[run]};
+    }
+
+private:
+    const ScanResult &scan;
+    size_t n_runs = 0;
+    std::vector<size_t> slice_start;      // Position of the first run of each slice, then n_runs
+    std::vector<size_t> slice_first_run;  // Index of the first run of each slice in scan
+    mutable size_t cur = 0;               // Slice of the last run read
+};
+
+// Lifetimes of contiguous runs across successive snapshots (see lifetimes.cpp)
+#define LIFETIME_BUCKETS 40
+class RunTracker {
+public:
+    // Runs of the next snapshot, sorted by VPN as load_runs returns them, taken at time
+    void update(const std::vector<SnapshotRun> &runs, double time);
+    // Runs of the next scan, taken at time
+    void update(const ScanResult &scan, double time);
+    // Survival table by run order
+    void write(std::ostream &out) const;
+
+private:
+    struct LiveRun {
+        u64 VPN;
+        u64 PFN;
+        u64 length;
+        double birth;
+        bool initial;  // Seen in the first snapshot, birth unknown
+    };
+    void death(const LiveRun &run, double time);
+    template <typename Runs>
+    void update_runs(const Runs &runs, double time);
+
+    std::vector<LiveRun> live;  // Runs of the last snapshot, by VPN
+    bool first = true;
+    double first_time = 0;
+    double last_time = 0;
+    u64 born[CONT_MAX_ORDER + 1] = {0};
+    u64 died[CONT_MAX_ORDER + 1] = {0};
+    u64 initial[CONT_MAX_ORDER + 1] = {0};
+    u64 deaths[CONT_MAX_ORDER + 1][LIFETIME_BUCKETS] = {{0}};
+    double total_lifetime[CONT_MAX_ORDER + 1] = {0};
+};
+
+// Translation entries needed to map a run list under one TLB model (see tlb.cpp)
+struct TlbModel {
+    std::string name;
+    std::vector<std::pair<u64, u64>> entries;  // (pages per entry, entries), largest entries first
+    u64 n_entries() const;
+    u64 reach(u64 capacity) const;
+};
+std::vector<TlbModel> tlb_models(const std::vector<SnapshotRun> &runs, const std::vector<int> &coalesce_ways);
+
+// Access-weighted TLB simulation of the tlb_models models (see tlb_sim.cpp)
+struct TlbGeometry {
+    int sets = 128;          // Power of 2
+    int ways = 12;
+    int range_entries = 32;  // Range translations are looked up by address, fully associative
+};
+// Misses of one model, in the order of tlb_models
+struct TlbSimResult {
+    u64 accesses = 0;
+    u64 misses = 0;
+};
+bool load_access_histogram(const std::string &path, std::vector<std::pair<u64, u64>> &histogram);
+std::vector<TlbSimResult> simulate_histogram(const std::vector<SnapshotRun> &runs, const std::vector<std::pair<u64, u64>> &histogram,
+                                             u64 n_accesses, u64 seed, const std::vector<int> &coalesce_ways,
+                                             const TlbGeometry &geometry, int n_threads, u64 &untracked);
+std::vector<TlbSimResult> simulate_trace(const std::vector<SnapshotRun> &runs, const uint64_t *addresses, size_t n,
+                                         const std::vector<int> &coalesce_ways, const TlbGeometry &geometry, int n_threads,
+                                         u64 &untracked);
+
+// =================================================================================================
+// Walk two VPN-sorted, non-overlapping run lists together, in VPN order
+//  - Run lists are anything indexed like a vector of SnapshotRun: a.size() and a[i].VPN, .PFN, .length
+//  - Calls only_a(ia, vpn, pfn, len) for pages mapped only by a[ia], only_b(ib, vpn, pfn, len) for
+//    pages mapped only by b[ib], and both(ia, ib, vpn, pfn_a, pfn_b, len) for pages mapped by both
+//  - Each call covers the longest stretch of pages with the same runs, so the work is proportional
+//    to the number of runs, not pages
+// =================================================================================================
+template <typename RunsA, typename RunsB, typename OnlyA, typename OnlyB, typename Both>
+void sweep_runs(const RunsA &a, const RunsB &b, OnlyA only_a, OnlyB only_b, Both both) {
+    const u64 none = ~(u64) 0;
+    size_t ia = 0, ib = 0;
+    u64 a_off = 0, b_off = 0;
+    while (ia < a.size() || ib < b.size()) {
+        u64 a_vpn = ia < a.size() ? a[ia].VPN + a_off : none;
+        u64 b_vpn = ib < b.size() ? b[ib].VPN + b_off : none;
+        u64 a_left = ia < a.size() ? a[ia].length - a_off : 0;
+        u64 b_left = ib < b.size() ? b[ib].length - b_off : 0;
+        u64 len;
+        if (a_vpn < b_vpn) {
+            len = std::min(a_left, b_vpn - a_vpn);
+            only_a(ia, a_vpn, a[ia].PFN + a_off, len);
+            a_off += len;
+        }
+        else if (b_vpn < a_vpn) {
+            len = std::min(b_left, a_vpn - b_vpn);
+            only_b(ib, b_vpn, b[ib].PFN + b_off, len);
+            b_off += len;
+        }
+        else {
+            len = std::min(a_left, b_left);
+            both(ia, ib, a_vpn, a[ia].PFN + a_off, b[ib].PFN + b_off, len);
+            a_off += len;
+            b_off += len;
+        }
+        if (ia < a.size() && a_off == a[ia].length) {
+            ia++;
+            a_off = 0;
+        }
+        if (ib < b.size() && b_off == b[ib].length) {
+            ib++;
+            b_off = 0;
+        }
+    }
+}
@@ -11,40 +11,636 @@
 #include <cstdint>
 #include <cassert>
 #include <filesystem>
+#include <random>
 #include "pmap.h"
 
 using namespace std;
 
 float coverage = 0.9;
 int require_alignment = 0;
+int max_order = CONT_HIGHEST;
 map<u64, int> region_sizes;
-vector<u64> region_starts_V;
-vector<u64> region_lengths;
-vector<u64> region_starts_P;
+
+// Options shared by every sample of a process
+struct SampleOptions {
+    string out_file;
+    int max_regions;
+    bool pmap_stdin;
+    bool use_scan;
+    int n_threads;
+    bool binary;
+    const NodeMap *nodes;  // Per-node breakdown with --numa, null otherwise
+    bool split_nodes;
+    ScanBudget budget;     // --max-cpu-pct and --pages-per-ms
+    u64 n_probes;          // Estimate from this many random pages with --sample, 0 for a full scan
+    bool vmas;             // Write the per-mapping summary with --vmas
+};
+
+// One contiguity sample of a process
+struct Sample {
+    size_t virtual_size = 0;
+    size_t rss = 0;
+    size_t n_mappings = 0;
+    std::vector<MemoryRegion> regions;  // Scanned regions, in the order of their runs
+    ScanResult scan;
+    NodeBreakdown by_node;
+    ContiguityEstimate estimate;  // With --sample, scan then only holds the estimated totals
+    double span_ms = 0;  // Wall time from reading smaps to the end of the scan
+    double cpu_ms = 0;   // CPU time used in that span
+};
+
+// Columns of the cost of a sample, printed when a budget is set
+static const string cost_columns = "Span-ms,CPU-ms";
+
+// Per-node breakdown of a scan, with --split-nodes the histogram becomes the sum of the node
+// histograms, so runs crossing a node boundary are counted as separate pieces
+static void break_down_by_node(const SampleOptions &opts, ScanResult &scan, NodeBreakdown &by_node)
+{
+    count_by_node(scan, *opts.nodes, by_node);
+    if (opts.split_nodes) {
+        for (int i = 0; i <= CONT_MAX_ORDER - CONT_LOWEST; i++) {
+            scan.power2_regions[i] = 0;
+            for (const auto &node : by_node.power2_regions) {
+                scan.power2_regions[i] += node[i];
+            }
+        }
+    }
+}
+
+// Estimate the summary row of a sample from opts.n_probes random pages of regions
+static bool estimate_contiguity(const vector<MemoryRegion> &regions, int pagemap_fd, const SampleOptions &opts, Sample &sample)
+{
+    ContiguityEstimate &estimate = sample.estimate;
+    if (!estimate_regions(regions, pagemap_fd, opts.n_probes, random_device()(), estimate)) {
+        cerr << "Failed to read pagemap entries\n";
+        return false;
+    }
+    double pages_per_probe = double(estimate.virtual_pages) / estimate.n_probes;
+    sample.scan.total_pages = llround(estimate.mapped_hits * pages_per_probe);
+    for (int i = 0; i <= max_order - CONT_LOWEST; i++) {
+        sample.scan.power2_regions[i] = llround(estimate.order_hits[i] * pages_per_probe / ((u64) 1 << (i + CONT_LOWEST)));
+    }
+    return true;
+}
+
+// Find the largest regions of pid and scan them for contiguous regions
+static int take_sample(pid_t pid, int pagemap_fd, const SampleOptions &opts, Sample &sample)
+{
+    int max_regions = opts.max_regions;
+    ScanPacer pacer(opts.budget);
+    // Find regions
+    vector<MemoryRegion> regions;
+    if (opts.pmap_stdin) {
+        parsePmapOutput(regions, sample.rss, max_regions != -1);
+    } else if (!parseSmaps(pid, regions, sample.rss, max_regions != -1)) {
+        cerr << "Failed to read smaps of pid " << pid << endl;
+        return EXIT_FAILURE;
+    }
+    vector<MemoryRegion> largestRegions = findLargestRegions(regions, sample.rss, coverage, max_regions);
+    // cerr << "Regions (" << coverage * 100 << "% RSS):\t" << largestRegions.size() << endl;
+
+    if (opts.n_probes > 0) {
+        if (!estimate_contiguity(largestRegions, pagemap_fd, opts, sample)) {
+            return EXIT_FAILURE;
+        }
+    }
+    // Scan regions
+    else if (!scan_regions(largestRegions, pagemap_fd, opts.use_scan, opts.n_threads, sample.scan,
+                      opts.budget.enabled() ? &pacer : nullptr)) {
+        cerr << "Failed to read pagemap entries\n";
+        return EXIT_FAILURE;
+    }
+    sample.span_ms = pacer.span_ms();
+    sample.cpu_ms = pacer.cpu_ms();
+    for (const auto &region : largestRegions) {
+        sample.virtual_size += region.size;
+    }
+    sample.n_mappings = largestRegions.size();
+    sample.regions = move(largestRegions);
+    if (opts.nodes) {
+        break_down_by_node(opts, sample.scan, sample.by_node);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Print the summary row of a sample, without a trailing newline
+// Order:
+// 1. Total tracked RSS
+// 2. Percentage of total RSS
+// 3. Mappings Scanned
+// 4-. Number of regions of size 2^0, 2^1, ..., 2^max_order
+static void print_row(const Sample &sample, ostream &row)
+{
+    double virtual_gb = double(sample.virtual_size) / 1024 / 1024 / 1024;
+    double tracked_rss_gb = double(sample.scan.total_pages) * 4096 / 1024 / 1024 / 1024;
+    double rss_gb = double(sample.rss) / 1024 / 1024 / 1024;
+    row << dec << fixed << setprecision(3);
+    row << virtual_gb << " GB," << tracked_rss_gb << "GB," << rss_gb << "GB," << sample.n_mappings;
+    for (int i = 0; i <= max_order - CONT_LOWEST; i++) {
+        row << "," << sample.scan.power2_regions[i];
+    }
+}
+
+// Print the cost columns of a sample, with a leading comma
+static void print_cost(const Sample &sample, ostream &row)
+{
+    row << fixed << setprecision(1) << "," << sample.span_ms << "," << sample.cpu_ms << setprecision(3);
+}
+
+// Ensure file has RW permissions
+static void set_permissions(const string &out_file)
+{
+    filesystem::permissions(out_file,
+        filesystem::perms::owner_read | filesystem::perms::owner_write |
+        filesystem::perms::group_read | filesystem::perms::group_write |
+        filesystem::perms::others_read | filesystem::perms::others_write,
+        filesystem::perm_options::replace
+    );
+}
+
+// Write data on contiguous regions to out_file, as text or as a binary snapshot
+//  - Text lines are tagged with the maps index of the mapping the run belongs to, in hex like the
+//    other columns (see write_vmas)
+static int write_runs(const string &out_file, const Sample &sample, bool binary)
+{
+    const ScanResult &scan = sample.scan;
+    if (binary) {
+        if (!write_snapshot(out_file, scan.region_starts_V.data(), scan.region_starts_P.data(),
+                scan.region_lengths.data(), scan.region_lengths.size())) {
+            cerr << "Failed to write file " << out_file << endl;
+            return EXIT_FAILURE;
+        }
+    }
+    else {
+        ofstream out(out_file);
+        if (!out.is_open()) {
+            cerr << "Failed to open file " << out_file << endl;
+            return EXIT_FAILURE;
+        }
+        out << "VPN,PFN,Size,VMA\n";
+        for (size_t r = 0; r < sample.regions.size(); r++) {
+            for (size_t i = scan.region_first_run[r]; i < scan.region_first_run[r + 1]; i++) {
+                out << hex << scan.region_starts_V[i] << "," << scan.region_starts_P[i] << "," << scan.region_lengths[i]
+                    << "," << sample.regions[r].index << dec << '\n';
+            }
+        }
+        out.close();
+    }
+    set_permissions(out_file);
+    return EXIT_SUCCESS;
+}
+
+// Write a summary of every scanned mapping to out_file, in the order of the run file
+//  - "VMA,Start,End,Perms,Tracked-RSS,Runs,4K,8K,...,Mapping", VMA is the index of the mapping in
+//    /proc/<pid>/maps and tags its runs in the run file, VMA, Start and End are hex
+//  - The histogram counts the runs of the mapping only, Mapping comes last as it may contain spaces
+static int write_vmas(const string &out_file, const Sample &sample)
+{
+    ofstream out(out_file);
+    if (!out.is_open()) {
+        cerr << "Failed to open file " << out_file << endl;
+        return EXIT_FAILURE;
+    }
+    out << "VMA,Start,End,Perms,Tracked-RSS,Runs";
+    for (int order = CONT_LOWEST; order <= max_order; order++) {
+        out << "," << order_name(order);
+    }
+    out << ",Mapping\n" << fixed << setprecision(3);
+
+    const ScanResult &scan = sample.scan;
+    pow2_counter counter = get_pow2_counter(require_alignment, max_order);
+    for (size_t r = 0; r < sample.regions.size(); r++) {
+        const MemoryRegion &region = sample.regions[r];
+        size_t first = scan.region_first_run[r];
+        size_t n_runs = scan.region_first_run[r + 1] - first;
+        u64 counts[CONT_MAX_ORDER - CONT_LOWEST + 1] = {0};
+        counter(scan.region_starts_P.data() + first, scan.region_starts_V.data() + first,
+                scan.region_lengths.data() + first, n_runs, counts);
+        u64 pages = accumulate(scan.region_lengths.begin() + first, scan.region_lengths.begin() + first + n_runs, (u64) 0);
+
+        out << hex << region.index << "," << region.address << "," << region.address + region.size << dec << ","
+            << region.perms << "," << double(pages) * 4096 / 1024 / 1024 / 1024 << "GB," << n_runs;
+        for (int i = 0; i <= max_order - CONT_LOWEST; i++) {
+            out << "," << counts[i];
+        }
+        string name = region.name;
+        replace(name.begin(), name.end(), ',', ' ');
+        out << "," << name << "\n";
+    }
+    out.close();
+    set_permissions(out_file);
+    return EXIT_SUCCESS;
+}
+
+// Write the estimate of a --sample run to out_file, with 95% confidence intervals
+//  - "Order,Share,Share-Low,Share-High,Regions,Regions-Low,Regions-High", one row per order
+//  - Share is the fraction of the mapped memory in pages of that order, Regions the number of pages
+//  - A last "mapped" row holds the fraction of the probed pages that are mapped and their number
+static int write_estimate(const string &out_file, const ContiguityEstimate &estimate)
+{
+    ofstream out(out_file);
+    if (!out.is_open()) {
+        cerr << "Failed to open file " << out_file << endl;
+        return EXIT_FAILURE;
+    }
+    out << "Order,Share,Share-Low,Share-High,Regions,Regions-Low,Regions-High\n" << fixed;
+    double pages_per_probe = estimate.n_probes ? double(estimate.virtual_pages) / estimate.n_probes : 0;
+    auto write_row = [&](const string &name, u64 hits, u64 n, double share_low, double share_high, u64 page_pages) {
+        double low, high;
+        wilson_interval(hits, estimate.n_probes, low, high);
+        double scale = double(estimate.virtual_pages) / page_pages;
+        out << name << "," << setprecision(4) << (n ? double(hits) / n : 0) << "," << share_low << "," << share_high
+            << "," << setprecision(0) << hits * pages_per_probe / page_pages << "," << low * scale << "," << high * scale << "\n";
+    };
+    for (int i = 0; i <= max_order - CONT_LOWEST; i++) {
+        double low, high;
+        wilson_interval(estimate.order_hits[i], estimate.mapped_hits, low, high);
+        write_row(order_name(i + CONT_LOWEST), estimate.order_hits[i], estimate.mapped_hits, low, high, (u64) 1 << (i + CONT_LOWEST));
+    }
+    double low, high;
+    wilson_interval(estimate.mapped_hits, estimate.n_probes, low, high);
+    write_row("mapped", estimate.mapped_hits, estimate.n_probes, low, high, 1);
+    out.close();
+    set_permissions(out_file);
+    return EXIT_SUCCESS;
+}
+
+// Write the per-node breakdown to out_file, "Node,Tracked-RSS,4K,8K,..." with one row per node
+//  - Pages outside every node, if any, are in a last row named "none"
+static int write_nodes(const string &out_file, const NodeBreakdown &by_node)
+{
+    ofstream out(out_file);
+    if (!out.is_open()) {
+        cerr << "Failed to open file " << out_file << endl;
+        return EXIT_FAILURE;
+    }
+    out << "Node,Tracked-RSS";
+    for (int order = CONT_LOWEST; order <= max_order; order++) {
+        out << "," << order_name(order);
+    }
+    out << "\n" << fixed << setprecision(3);
+    size_t none = by_node.pages.size() - 1;
+    for (size_t slot = 0; slot < by_node.pages.size(); slot++) {
+        if (slot == none && by_node.pages[slot] == 0) {
+            continue;
+        }
+        out << (slot == none ? "none" : to_string(slot)) << "," << double(by_node.pages[slot]) * 4096 / 1024 / 1024 / 1024 << "GB";
+        for (int i = 0; i <= max_order - CONT_LOWEST; i++) {
+            out << "," << by_node.power2_regions[slot][i];
+        }
+        out << "\n";
+    }
+    out.close();
+    set_permissions(out_file);
+    return EXIT_SUCCESS;
+}
+
+// Add the runs of a scan to tracker as a snapshot taken at time, then rewrite its survival table
+// to out_file (see lifetimes.cpp)
+static int write_lifetimes(const string &out_file, const ScanResult &scan, RunTracker &tracker, double time)
+{
+    tracker.update(scan, time);
+
+    ofstream out(out_file);
+    if (!out.is_open()) {
+        cerr << "Failed to open file " << out_file << endl;
+        return EXIT_FAILURE;
+    }
+    tracker.write(out);
+    out.close();
+    set_permissions(out_file);
+    return EXIT_SUCCESS;
+}
+
+// Take one contiguity sample of pid
+//  - Prints the summary row (without a trailing newline) to row
+//  - Writes the contiguous regions to opts.out_file, with --vmas a summary per mapping to
+//    <out_file>.vmas, with --numa the per-node breakdown to <out_file>.numa
+//  - With a tracker, adds the runs to it as taken at time and writes its survival table to
+//    <out_file>.lifetimes
+static int sample_contiguity(pid_t pid, int pagemap_fd, const SampleOptions &opts, ostream &row,
+                             RunTracker *tracker = nullptr, double time = 0)
+{
+    Sample sample;
+    if (take_sample(pid, pagemap_fd, opts, sample) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    print_row(sample, row);
+    if (opts.budget.enabled()) {
+        print_cost(sample, row);
+    }
+    if (opts.n_probes > 0) {
+        return write_estimate(opts.out_file, sample.estimate);
+    }
+    if ((opts.vmas && write_vmas(opts.out_file + ".vmas", sample) != EXIT_SUCCESS) ||
+            (opts.nodes && write_nodes(opts.out_file + ".numa", sample.by_node) != EXIT_SUCCESS)) {
+        return EXIT_FAILURE;
+    }
+    if (write_runs(opts.out_file, sample, opts.binary) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    return tracker ? write_lifetimes(opts.out_file + ".lifetimes", sample.scan, *tracker, time) : EXIT_SUCCESS;
+}
+
+static int open_pagemap(pid_t pid)
+{
+    char pagemap_file[BUFSIZ];
+    snprintf(pagemap_file, sizeof(pagemap_file), "/proc/%ju/pagemap", (uintmax_t)pid);
+    return open(pagemap_file, O_RDONLY);
+}
+
+// PAGEMAP_SCAN skips absent pages in the kernel, fall back to reading every entry without it
+//  - Support is a property of the kernel, so the fallback of --backend scan is reported once
+static bool use_pagemap_scan(int pagemap_fd, const string &backend)
+{
+    static bool warned = false;
+    bool use_scan = backend != "pread" && pagemap_scan_supported(pagemap_fd);
+    if (backend == "scan" && !use_scan && !warned) {
+        cerr << "PAGEMAP_SCAN not supported, falling back to pread\n";
+        warned = true;
+    }
+    return use_scan;
+}
+
+// =================================================================================================
+// Take one contiguity sample of every process in pids
+//  - Contiguous regions of each process go to <out_file>.<pid>, with --vmas its mappings to
+//    <out_file>.<pid>.vmas. With --numa, per-node breakdowns go to <out_file>.<pid>.numa and, for
+//    the processes combined, to <out_file>.numa
+//  - Prints one row per process and an "all" row for the processes combined. Frames mapped by more
+//    than one process (or more than once by one process) are counted once in the "all" row.
+//  - Shared-RSS is the part of the tracked RSS whose frames are mapped more than once
+//  - Processes that exit before they are sampled are skipped
+//  - The scan reads no frame flags (huge pages show up as runs), so the only per-frame state the
+//    processes share is the NUMA node map of --numa, loaded once for all of them
+// =================================================================================================
+static int sample_processes(const vector<pid_t> &pids, const string &backend, const SampleOptions &opts)
+{
+    vector<pid_t> sampled;
+    vector<Sample> samples;
+    samples.reserve(pids.size());
+    for (pid_t pid : pids) {
+        int pagemap_fd = open_pagemap(pid);
+        if (pagemap_fd < 0) {
+            cerr << "Skipping pid " << pid << ": cannot open pagemap\n";
+            continue;
+        }
+        SampleOptions pid_opts = opts;
+        pid_opts.use_scan = use_pagemap_scan(pagemap_fd, backend);
+        Sample sample;
+        int ret = take_sample(pid, pagemap_fd, pid_opts, sample);
+        close(pagemap_fd);
+        if (ret != EXIT_SUCCESS) {
+            cerr << "Skipping pid " << pid << endl;
+            continue;
+        }
+        string pid_file = opts.out_file + "." + to_string(pid);
+        if (write_runs(pid_file, sample, opts.binary) != EXIT_SUCCESS ||
+                (opts.vmas && write_vmas(pid_file + ".vmas", sample) != EXIT_SUCCESS) ||
+                (opts.nodes && write_nodes(pid_file + ".numa", sample.by_node) != EXIT_SUCCESS)) {
+            return EXIT_FAILURE;
+        }
+        sampled.push_back(pid);
+        samples.push_back(move(sample));
+    }
+    if (samples.empty()) {
+        cerr << "No process could be sampled\n";
+        return EXIT_FAILURE;
+    }
+
+    // Combine the processes, counting shared frames once
+    Sample all;
+    vector<const ScanResult *> scans;
+    for (const auto &sample : samples) {
+        all.virtual_size += sample.virtual_size;
+        all.rss += sample.rss;
+        all.n_mappings += sample.n_mappings;
+        all.span_ms += sample.span_ms;
+        all.cpu_ms += sample.cpu_ms;
+        scans.push_back(&sample.scan);
+    }
+    vector<u64> shared_pages;
+    u64 shared_frames = merge_scans(scans, opts.n_threads, all.scan, shared_pages);
+    if (opts.nodes) {
+        break_down_by_node(opts, all.scan, all.by_node);
+        if (write_nodes(opts.out_file + ".numa", all.by_node) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto shared_gb = [](u64 pages) { return double(pages) * 4096 / 1024 / 1024 / 1024; };
+    bool cost = opts.budget.enabled();
+    print_header(cout, "Pid", cost ? "Shared-RSS," + cost_columns : "Shared-RSS");
+    for (size_t i = 0; i < samples.size(); i++) {
+        cout << sampled[i] << ",";
+        print_row(samples[i], cout);
+        cout << "," << shared_gb(shared_pages[i]) << "GB";
+        if (cost) {
+            print_cost(samples[i], cout);
+        }
+        cout << "\n";
+    }
+    cout << "all,";
+    print_row(all, cout);
+    cout << "," << shared_gb(shared_frames) << "GB";
+    if (cost) {
+        print_cost(all, cout);
+    }
+    cout << endl;
+    return EXIT_SUCCESS;
+}
+
+// Pids of every process in a cgroup (v2) and its descendants, except this one
+//  - path is a cgroup directory, or relative to /sys/fs/cgroup
+static bool cgroup_pids(string path, vector<pid_t> &pids)
+{
+    if (!filesystem::exists(path + "/cgroup.procs")) {
+        path = "/sys/fs/cgroup/" + path;
+    }
+    if (!filesystem::exists(path + "/cgroup.procs")) {
+        cerr << "Error: " << path << " is not a cgroup\n";
+        return false;
+    }
+    vector<string> dirs = {path};
+    for (const auto &entry : filesystem::recursive_directory_iterator(path, filesystem::directory_options::skip_permission_denied)) {
+        if (entry.is_directory()) {
+            dirs.push_back(entry.path().string());
+        }
+    }
+    for (const auto &dir : dirs) {
+        ifstream procs(dir + "/cgroup.procs");
+        pid_t pid;
+        while (procs >> pid) {
+            if (pid != getpid()) {
+                pids.push_back(pid);
+            }
+        }
+    }
+    return true;
+}
+
+// Comma separated list of pids
+static bool parse_pids(const string &list, vector<pid_t> &pids)
+{
+    istringstream in(list);
+    string pid;
+    while (getline(in, pid, ',')) {
+        if (pid.empty() || pid.find_first_not_of("0123456789") != string::npos) {
+            cerr << "Invalid pid: " << pid << endl;
+            return false;
+        }
+        pids.push_back(stoul(pid));
+    }
+    return true;
+}
 
 // Finds the largest memory regions of a process that consume at least 80% of the total RSS
 // For each region, prints the mapping of every virtual page (VPN and PFN)
+// - Runs are tagged with their mapping, with --vmas summarized per mapping in <outfile>.vmas
+// - With --binary, the mappings are written as a binary snapshot (see snapshot.cpp)
 // Input:
 // - pid: the process ID
-// - stdin: the output of pmap -x <pid>
+// - stdin: the output of pmap -x <pid>, only with --stdin (otherwise /proc/<pid>/smaps is read directly)
+// With --numa, writes tracked RSS and power-of-2 regions per NUMA node to <outfile>.numa
+// - With --split-nodes, runs crossing a node boundary are also counted as separate pieces in the row
+// With --daemon, samples every interval-ms until the process exits, one CSV row per sample
+// - With --lifetimes, tracks how long runs survive across samples, in seconds, and rewrites the
+//   survival table to <outfile>.lifetimes after every sample (see lifetimes.cpp)
+// With --pids a,b,c or --cgroup <path>, samples every listed process once instead of <pid> (see sample_processes)
+// With --sample N, estimates the row from N random pages of the regions instead of scanning them, and
+// writes the estimate with 95% confidence intervals to <outfile> (see estimate.cpp and write_estimate).
+// Options of a full scan (--pids, --cgroup, --numa, --split-nodes, --binary, --vmas, the budget, -j,
+// --backend scan) are rejected with it.
+// With --max-cpu-pct P or --pages-per-ms N, scans in small chunks and sleeps between them so a sample
+// uses at most P% of a CPU, or walks at most N virtual pages per ms. Rows then end with the wall
+// time the sample spanned and the CPU time it used, "Span-ms,CPU-ms".
 int main(int argc, char **argv)
 {
-    if (argc < 3) {
-        cerr << "Usage: sudo "<< argv[0] << " <pid> <outfile> [max_regions] [require_alignment]\n";
+    // Options may appear anywhere, everything else is positional
+    string backend = "auto";
+    int n_threads = 1;
+    bool pmap_stdin = false;
+    bool binary = false;
+    bool vmas = false;
+    bool daemon = false;
+    bool lifetimes = false;
+    long interval_ms = 1000;
+    vector<pid_t> pids;
+    bool multi = false;
+    bool numa = false;
+    bool split_nodes = false;
+    ScanBudget budget;
+    u64 n_probes = 0;
+    vector<string> args;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--backend" && i + 1 < argc) {
+            backend = argv[++i];
+            if (backend != "auto" && backend != "scan" && backend != "pread") {
+                cerr << "Invalid value for backend: " << backend << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--daemon") {
+            daemon = true;
+        }
+        else if (arg == "--lifetimes") {
+            lifetimes = true;
+        }
+        else if (arg == "--interval-ms" && i + 1 < argc) {
+            interval_ms = stol(argv[++i]);
+            if (interval_ms < 1) {
+                cerr << "Invalid interval: " << interval_ms << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--max-order" && i + 1 < argc) {
+            max_order = stoi(argv[++i]);
+            if (max_order < CONT_LOWEST || max_order > CONT_MAX_ORDER) {
+                cerr << "Invalid max order: " << max_order << " (" << CONT_LOWEST << "-" << CONT_MAX_ORDER << ")\n";
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--pids" && i + 1 < argc) {
+            multi = true;
+            if (!parse_pids(argv[++i], pids)) {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--cgroup" && i + 1 < argc) {
+            multi = true;
+            if (!cgroup_pids(argv[++i], pids)) {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--numa") {
+            numa = true;
+        }
+        else if (arg == "--split-nodes") {
+            numa = true;
+            split_nodes = true;
+        }
+        else if (arg == "--max-cpu-pct" && i + 1 < argc) {
+            budget.max_cpu_pct = stod(argv[++i]);
+            if (budget.max_cpu_pct <= 0) {
+                cerr << "Invalid CPU budget: " << budget.max_cpu_pct << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--pages-per-ms" && i + 1 < argc) {
+            budget.pages_per_ms = stod(argv[++i]);
+            if (budget.pages_per_ms <= 0) {
+                cerr << "Invalid scan rate: " << budget.pages_per_ms << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--sample" && i + 1 < argc) {
+            long long n = stoll(argv[++i]);
+            if (n < 1) {
+                cerr << "Invalid number of samples: " << n << endl;
+                return EXIT_FAILURE;
+            }
+            n_probes = n;
+        }
+        else if (arg == "--binary") {
+            binary = true;
+        }
+        else if (arg == "--vmas") {
+            vmas = true;
+        }
+        else if (arg == "--stdin") {
+            pmap_stdin = true;
+        }
+        else if (arg == "-j" && i + 1 < argc) {
+            n_threads = stoi(argv[++i]);
+            if (n_threads < 1) {
+                cerr << "Invalid number of threads: " << n_threads << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else {
+            args.push_back(arg);
+        }
+    }
+    // Without a pid, the first positional argument is the output file
+    size_t first = multi ? 0 : 1;
+    if (args.size() < first + 1) {
+        cerr << "Usage: sudo "<< argv[0] << " <pid> <outfile> [max_regions] [require_alignment] [--backend auto|scan|pread] [-j threads] [--max-order N] [--stdin] [--binary] [--vmas] [--numa [--split-nodes]] [--max-cpu-pct P] [--pages-per-ms N] [--sample N] [--daemon [--interval-ms N] [--lifetimes]]\n";
+        cerr << "       sudo "<< argv[0] << " --pids a,b,c|--cgroup <path> <outfile> [max_regions] [require_alignment] [options]\n";
         return EXIT_FAILURE;
     }
-    string out_file = argv[2];
+    string out_file = args[first];
 
     // If max regions is specified, use it instead of coverage
     int max_regions = INT32_MAX;
-    if (argc >= 4) {
+    if (args.size() >= first + 2) {
         coverage = 1;
-        max_regions = stoi(argv[3]);
+        max_regions = stoi(args[first + 1]);
     }
 
     // If require_alignment is specified, use it
-    if (argc >= 5) {
-        string arg = argv[4];
+    if (args.size() >= first + 3) {
+        string arg = args[first + 2];
         if (arg == "true" || arg == "1") {
             require_alignment = 1;
         } else if (arg == "false" || arg == "0") {
@@ -55,175 +651,72 @@ int main(int argc, char **argv)
         }
     }
 
-    // Find regions
-    vector<MemoryRegion> regions;
-    size_t totalRSS;
-    parsePmapOutput(regions, totalRSS, max_regions != -1);
-    vector<MemoryRegion> largestRegions = findLargestRegions(regions, totalRSS, coverage, max_regions);
-    // cerr << "Regions (" << coverage * 100 << "% RSS):\t" << largestRegions.size() << endl;
-
-    // Open pagemap file for this pid
-    pid_t pid = stoul(argv[1]);
-    char pagemap_file[BUFSIZ];
-    snprintf(pagemap_file, sizeof(pagemap_file), "/proc/%ju/pagemap", (uintmax_t)pid);
-    int pagemap_fd = open(pagemap_file, O_RDONLY);
-
-    // Open /proc/kpageflags
-    char kpageflags_file[BUFSIZ];
-    snprintf(kpageflags_file, sizeof(kpageflags_file), "/proc/kpageflags");
-    int kflags_fd = open(kpageflags_file, O_RDONLY);
-
-    // Region data
-    u64 power2_regions[CONT_HIGHEST - CONT_LOWEST + 1] = {0};
-    u64 n_regions = 0;
-    u64 total_pages = 0;
-
-    // Loop through virtual memory areas
-    size_t pageSize = sysconf(_SC_PAGE_SIZE);
-    size_t total_virtual_size = 0;
-    vector<tuple<uintptr_t, uintptr_t, uint64_t>> mappings;
-    for (const auto &region : largestRegions) {
-        u64 last_VPN = 0;
-        u64 last_PFN = 0;
-        u64 region_size = 0;
-        total_virtual_size += region.size;
-        // for (size_t i = 0; i < region.size; i += pageSize) {
-        for (size_t i = 0; i < region.size; ) {
-            // =================================================================
-            // Get virtual to physical mappings
-            // =================================================================
-            uintptr_t vaddr = region.address + i;
-            uintptr_t paddr;
-            if (virt_to_phys_user(&paddr, vaddr, pagemap_fd, kflags_fd)) {
-                cerr << "Failed to convert virtual address to physical\n";
-                return EXIT_FAILURE;
-            }
-            assert( (vaddr & 0xFFF) == 0);
-            assert( (paddr & 0xFFF) == 0 || (paddr & 0xFFF) == 1);
-            bool thp = paddr & 1;
-            if (thp) i += pageSize * 512;
-            else i += pageSize;
-
-            // =================================================================
-            // Analyze contiguity
-            // =================================================================
-            // Check if mapping is valid
-            u64 VPN = vaddr >> 12;
-            u64 PFN = paddr >> 12;
-            if (PFN == 0) {
-                assert(!thp);
-                if (region_size > 0) {
-                    n_regions++;
-
-                    // Record region
-                    total_pages += region_size;
-
-                    // Get number of each power of 2 region
-                    u64 start = last_PFN - region_size + 1;
-                    u64 end = last_PFN + 1;
-                    u64 v_start = last_VPN - region_size + 1;
-                    if (require_alignment) {
-                        count_pow2_aligned(start, end, v_start, CONT_HIGHEST, power2_regions);
-                    } else {
-                        count_pow2(start, end, CONT_HIGHEST, power2_regions);
-                    }
-
-                    // Track region start
-                    region_starts_V.push_back(last_VPN - region_size + 1);
-                    region_lengths.push_back(region_size);
-                    region_starts_P.push_back(last_PFN - region_size + 1);
-
-                    // Reset region
-                    region_size = 0;
-                }
-            }
-            // Continues contiguous region
-            else {
-                if (VPN == last_VPN + 1 && PFN == last_PFN + 1) {
-                    // region_size++;
-                    if (thp)
-                        region_size += 512;
-                    else
-                        region_size++;
-                }
-                // New region started
-                else {
-                    if (region_size > 0) {
-                        n_regions++;
-
-                        // Record region
-                        total_pages += region_size;
-
-                        // Get number of each power of 2 region
-                        u64 start = last_PFN - region_size + 1;
-                        u64 end = last_PFN + 1;
-                        u64 v_start = last_VPN - region_size + 1;
-                        if (require_alignment) {
-                            count_pow2_aligned(start, end, v_start, CONT_HIGHEST, power2_regions);
-                        } else {
-                            count_pow2(start, end, CONT_HIGHEST, power2_regions);
-                        }
-
-                        // Track region start
-                        region_starts_V.push_back(last_VPN - region_size + 1);
-                        region_lengths.push_back(region_size);
-                        region_starts_P.push_back(last_PFN - region_size + 1);
-                    }
-                    if (thp)
-                        region_size = 512;
-                    else
-                        region_size = 1;
-                }
-                // Update last VPN and PFN
-                if (thp) {
-                    last_VPN = VPN + 511;
-                    last_PFN = PFN + 511;
-                }
-                else {
-                    last_VPN = VPN;
-                    last_PFN = PFN;
-                }
-            }
+    if (daemon && pmap_stdin) {
+        cerr << "--daemon reads smaps for every sample and cannot be combined with --stdin\n";
+        return EXIT_FAILURE;
+    }
+    if (lifetimes && (!daemon || n_probes > 0)) {
+        cerr << "--lifetimes tracks runs across the samples of --daemon and cannot be combined with --sample\n";
+        return EXIT_FAILURE;
+    }
+    if (n_probes > 0) {
+        // Probes read a few pagemap entries around each random page, from one thread, and write an
+        // estimate instead of runs: none of the options of a scan apply
+        string ignored;
+        if (multi) ignored += " --pids/--cgroup";
+        if (numa) ignored += split_nodes ? " --split-nodes" : " --numa";
+        if (binary) ignored += " --binary";
+        if (vmas) ignored += " --vmas";
+        if (budget.enabled()) ignored += " --max-cpu-pct/--pages-per-ms";
+        if (n_threads > 1) ignored += " -j";
+        if (backend == "scan") ignored += " --backend scan";
+        if (!ignored.empty()) {
+            cerr << "--sample writes an estimate from single page probes and cannot be combined with" << ignored << "\n";
+            return EXIT_FAILURE;
         }
     }
-    close(pagemap_fd);
-    close(kflags_fd);
-
-    //==================================================================================================
-    // Print results
-    //==================================================================================================
-    // Order:
-    // 1. Total tracked RSS
-    // 2. Percentage of total RSS
-    // 3. Mappings Scanned
-    // 4-18. Number of regions of size 2^4, 2^5, ..., 2^18
-    double virtual_gb = double(total_virtual_size) / 1024 / 1024 / 1024;
-    double tracked_rss_gb = double(total_pages) * 4096 / 1024 / 1024 / 1024;
-    double rss_gb = double(totalRSS) / 1024 / 1024 / 1024;
-    cout << dec << fixed << setprecision(3);
-    cout << virtual_gb << " GB," << tracked_rss_gb << "GB," << rss_gb << "GB," << largestRegions.size();
-    for (u64 r : power2_regions) {
-        cout << "," << r;
+    NodeMap nodes;
+    if (numa && !nodes.load()) {
+        return EXIT_FAILURE;
     }
-    cout << endl;
 
-    // Write data on contiguous regions to file
-    ofstream out(out_file);
-    if (!out.is_open()) {
-        cerr << "Failed to open file " << out_file << endl;
-        return EXIT_FAILURE;
+    if (multi) {
+        if (daemon || pmap_stdin) {
+            cerr << "--pids and --cgroup cannot be combined with --daemon or --stdin\n";
+            return EXIT_FAILURE;
+        }
+        sort(pids.begin(), pids.end());
+        pids.erase(unique(pids.begin(), pids.end()), pids.end());
+        SampleOptions opts = {out_file, max_regions, false, false, n_threads, binary, numa ? &nodes : nullptr, split_nodes, budget, 0, vmas};
+        return sample_processes(pids, backend, opts);
     }
-    out << "VPN,PFN,Size\n";
-    for (size_t i = 0; i < region_starts_V.size(); i++) {
-        out << hex << region_starts_V[i] << "," << region_starts_P[i] << "," << region_lengths[i] << endl;
+    pid_t pid = stoul(args[0]);
+
+    // Open pagemap file for this pid
+    int pagemap_fd = open_pagemap(pid);
+    if (pagemap_fd < 0) {
+        perror("open pagemap");
+        return EXIT_FAILURE;
     }
-    out.close();
 
-    // Ensure file has RW permissions
-    filesystem::permissions(out_file,
-        filesystem::perms::owner_read | filesystem::perms::owner_write |
-        filesystem::perms::group_read | filesystem::perms::group_write |
-        filesystem::perms::others_read | filesystem::perms::others_write,
-        filesystem::perm_options::replace
-    );
+    bool use_scan = use_pagemap_scan(pagemap_fd, backend);
+
+    SampleOptions opts = {out_file, max_regions, pmap_stdin, use_scan, n_threads, binary, numa ? &nodes : nullptr, split_nodes, budget, n_probes, vmas};
+
+    int ret;
+    if (daemon) {
+        // The pagemap fd and the live runs stay across samples
+        RunTracker tracker;
+        ret = run_daemon(pid, interval_ms, budget.enabled() ? cost_columns : "", [&](ostream &row, double time) {
+            return sample_contiguity(pid, pagemap_fd, opts, row, lifetimes ? &tracker : nullptr, time) == EXIT_SUCCESS;
+        });
+    }
+    else {
+        ret = sample_contiguity(pid, pagemap_fd, opts, cout);
+        if (ret == EXIT_SUCCESS) {
+            cout << endl;
+        }
+    }
+    close(pagemap_fd);
+    return ret;
 }
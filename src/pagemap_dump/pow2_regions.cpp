@@ -1,5 +1,8 @@
 #include <iostream>
 #include <assert.h>
+#include <algorithm>
+#include <array>
+#include <utility>
 #include "pmap.h"
 
 using namespace std;
@@ -7,85 +10,146 @@ using namespace std;
 // =================================================================================================
 // Given a start and end address, find the number of aligned pages of power-of-2 sizes
 //  - Regions used by a larger page cannot be re-used by a smaller page
+//  - Greedy decomposition into the largest aligned pages, no larger than 2^pow_largest:
+//      [start, A) | A ... B | [B, end)
+//    A and B are start and end rounded in to a multiple of 2^pow_largest. The middle holds
+//    (B - A) >> pow_largest pages of the largest size, and each side holds one page per set bit
+//    of its length. If no multiple of 2^pow_largest fits, the largest order that fits is the
+//    highest bit in which start and end differ.
+//  - Aligned: virtual and physical addresses advance together, so a page of order k is aligned in
+//    both exactly when the low k bits of v_start - start are zero. That caps the largest order.
+//  - Instantiated with a constant pow_largest and alignment policy by the run counters below, and
+//    with a runtime pow_largest by count_pow2 and count_pow2_aligned
 // =================================================================================================
-void count_pow2(u64 start, u64 end, int pow_largest, u64* region_count) {
-    // Return if pow_largest is less than the minimum we are considering
-    u64 region_size = end - start;
-    assert(region_size >= 0);
-    if (pow_largest < CONT_LOWEST || region_size == 0) return;
-
-    // Region too small
-    u64 pow_mask = (1 << pow_largest) - 1;
-    if (region_size < ((u64) 1 << pow_largest)) {
-        count_pow2(start, end, pow_largest - 1, region_count);
-        return;
+static inline void count_bits(u64 length, u64* region_count) {
+    length &= ~(((u64) 1 << CONT_LOWEST) - 1);
+    while (length) {
+        region_count[__builtin_ctzll(length) - CONT_LOWEST]++;
+        length &= length - 1;
     }
-    
-    // Check if an aligned page of order pow_largest can fit
-    //  - End can simply be truncated to the nearest page
-    //  - Start must be aligned to the nearest page greater than or equal to start
-    u64 end_aligned = end >> pow_largest;
-    u64 start_truncated = start >> pow_largest;
-    u64 start_aligned = start_truncated + (start % (1 << pow_largest) == 0 ? 0 : 1);
+}
 
-    // No aligned page can fit, continue
-    assert(start_aligned <= end_aligned);
-    if (start_aligned == end_aligned) {
-        count_pow2(start, end, pow_largest - 1, region_count);
-        return;
+template <bool Aligned>
+static inline void count_pow2_impl(u64 start, u64 end, u64 v_start, int pow_largest, u64* region_count) {
+    if (Aligned) {
+        u64 offset = v_start - start;
+        if (offset != 0) {
+            pow_largest = min(pow_largest, __builtin_ctzll(offset));
+        }
     }
-    
-    // Region can fit, increment count
-    u64 n_pages = end_aligned - start_aligned;
-    region_count[pow_largest - CONT_LOWEST] += n_pages;
+    if (pow_largest < CONT_LOWEST || start >= end) return;
 
-    // Lower sub-region
-    count_pow2(start, start_aligned << pow_largest, pow_largest - 1, region_count);
+    u64 a = ((start + ((u64) 1 << pow_largest) - 1) >> pow_largest) << pow_largest;
+    u64 b = (end >> pow_largest) << pow_largest;
+    if (a > b || a < start) {
+        pow_largest = 63 - __builtin_clzll(start ^ end);
+        if (pow_largest < CONT_LOWEST) {
+            return;
+        }
+        a = ((start + ((u64) 1 << pow_largest) - 1) >> pow_largest) << pow_largest;
+        b = (end >> pow_largest) << pow_largest;
+    }
+    region_count[pow_largest - CONT_LOWEST] += (b - a) >> pow_largest;
+    count_bits(a - start, region_count);
+    count_bits(end - b, region_count);
+}
 
-    // Upper sub-region
-    count_pow2(end_aligned << pow_largest, end, pow_largest - 1, region_count);
+void count_pow2(u64 start, u64 end, int pow_largest, u64* region_count) {
+    count_pow2_impl<false>(start, end, start, pow_largest, region_count);
 }
 
 // Aligned version of count_pow2
 void count_pow2_aligned(u64 start, u64 end, u64 v_start, int pow_largest, u64* region_count) {
-    // Return if pow_largest is less than the minimum we are considering
-    u64 region_size = end - start;
-    assert(region_size >= 0);
-    if (pow_largest < CONT_LOWEST || region_size == 0) return;
+    count_pow2_impl<true>(start, end, v_start, pow_largest, region_count);
+}
+
+// Pages of the decomposition never cross a multiple of 2^pow_largest frames, so the page holding pfn
+// only depends on the part of its run inside that window
+//  - Clamped rather than computed as VPN - (pfn - window start), which wraps below the mapping when
+//    VPN is smaller than the offset of pfn in its window (mappings in the first 2^pow_largest pages)
+void pow2_window(u64 VPN, u64 pfn, int pow_largest, u64 &lo, u64 &hi) {
+    u64 window = (u64) 1 << pow_largest;
+    u64 before = pfn & (window - 1);  // Frames of the window before pfn
+    u64 after = window - before;      // Frames from pfn to the end of the window
+    if (before <= VPN - lo) lo = VPN - before;
+    if (after <= hi - VPN) hi = VPN + after;
+}
+
+// Order of the page holding frame pfn in the decomposition count_pow2(_aligned) makes of [start, end)
+//  - Pages of [start, A) grow in address order, one per set bit of A - start from the lowest, pages
+//    of [B, end) shrink, one per set bit of end - B from the highest
+int pow2_order_at(u64 start, u64 end, u64 v_start, u64 pfn, bool aligned, int pow_largest) {
+    if (aligned) {
+        u64 offset = v_start - start;
+        if (offset != 0) {
+            pow_largest = min(pow_largest, __builtin_ctzll(offset));
+        }
+    }
+    if (pow_largest < CONT_LOWEST || pfn < start || pfn >= end) return -1;
 
-    // Region too small or virtual and physical alignment don't match, continue
-    u64 pow_mask = (1 << pow_largest) - 1;
-    if (region_size < ((u64) 1 << pow_largest)) {
-        count_pow2_aligned(start, end, v_start, pow_largest - 1, region_count);
-        return;
+    u64 a = ((start + ((u64) 1 << pow_largest) - 1) >> pow_largest) << pow_largest;
+    u64 b = (end >> pow_largest) << pow_largest;
+    if (a > b || a < start) {
+        pow_largest = 63 - __builtin_clzll(start ^ end);
+        if (pow_largest < CONT_LOWEST) {
+            return -1;
+        }
+        a = ((start + ((u64) 1 << pow_largest) - 1) >> pow_largest) << pow_largest;
+        b = (end >> pow_largest) << pow_largest;
     }
-    if ((start & pow_mask) != (v_start & pow_mask)) {
-        count_pow2_aligned(start, end, v_start, pow_largest - 1, region_count);
-        return;
+    if (pfn >= a && pfn < b) {
+        return pow_largest;
     }
-    
-    // Check if an aligned page of order pow_largest can fit
-    //  - End can simply be truncated to the nearest page
-    //  - Start must be aligned to the nearest page greater than or equal to start
-    u64 end_aligned = end >> pow_largest;
-    u64 start_truncated = start >> pow_largest;
-    u64 start_aligned = start_truncated + (start % (1 << pow_largest) == 0 ? 0 : 1);
+    if (pfn < a) {
+        u64 page_start = start;
+        for (u64 bits = a - start; bits; bits &= bits - 1) {
+            int order = __builtin_ctzll(bits);
+            page_start += (u64) 1 << order;
+            if (pfn < page_start) return order >= CONT_LOWEST ? order : -1;
+        }
+    }
+    else {
+        u64 page_start = b;
+        for (u64 bits = end - b; bits; bits &= ~((u64) 1 << (63 - __builtin_clzll(bits)))) {
+            int order = 63 - __builtin_clzll(bits);
+            page_start += (u64) 1 << order;
+            if (pfn < page_start) return order >= CONT_LOWEST ? order : -1;
+        }
+    }
+    return -1;
+}
 
-    // No aligned page can fit, continue
-    assert(start_aligned <= end_aligned);
-    if (start_aligned == end_aligned) {
-        count_pow2_aligned(start, end, v_start, pow_largest - 1, region_count);
-        return;
+// =================================================================================================
+// Run counters: count every run of a run list, with the alignment policy and largest order fixed at
+// compile time. One instantiation exists per policy and order up to CONT_MAX_ORDER, picked once per
+// run list by get_pow2_counter, so the loop over runs has no policy branch.
+// =================================================================================================
+template <bool Aligned, int MaxOrder>
+static void count_runs(const u64 *starts_P, const u64 *starts_V, const u64 *lengths, size_t n, u64 *region_count) {
+    for (size_t i = 0; i < n; i++) {
+        count_pow2_impl<Aligned>(starts_P[i], starts_P[i] + lengths[i], starts_V[i], MaxOrder, region_count);
     }
-    
-    // Region can fit, increment count
-    u64 n_pages = end_aligned - start_aligned;
-    region_count[pow_largest - CONT_LOWEST] += n_pages;
+}
 
-    // Lower sub-region
-    count_pow2_aligned(start, start_aligned << pow_largest, v_start, pow_largest - 1, region_count);
+template <bool Aligned, size_t... Orders>
+static constexpr array<pow2_counter, sizeof...(Orders)> make_counters(index_sequence<Orders...>) {
+    return {{&count_runs<Aligned, (int) Orders>...}};
+}
+
+static constexpr auto unaligned_counters = make_counters<false>(make_index_sequence<CONT_MAX_ORDER + 1>());
+static constexpr auto aligned_counters = make_counters<true>(make_index_sequence<CONT_MAX_ORDER + 1>());
 
-    // Upper sub-region
-    v_start += (end_aligned << pow_largest) - start;
-    count_pow2_aligned(end_aligned << pow_largest, end, v_start, pow_largest - 1, region_count);
-}
\ No newline at end of file
+// Run counter for the given alignment policy and largest order (CONT_LOWEST to CONT_MAX_ORDER)
+pow2_counter get_pow2_counter(bool aligned, int max_order) {
+    assert(max_order >= CONT_LOWEST && max_order <= CONT_MAX_ORDER);
+    return aligned ? aligned_counters[max_order] : unaligned_counters[max_order];
+}
+
+// Size of a page of the given order with 4K base pages
+string order_name(int order) {
+    u64 kb = (u64) 4 << order;
+    if (kb >= (1 << 30)) return to_string(kb >> 30) + "T";
+    if (kb >= (1 << 20)) return to_string(kb >> 20) + "G";
+    if (kb >= (1 << 10)) return to_string(kb >> 10) + "M";
+    return to_string(kb) + "K";
+}
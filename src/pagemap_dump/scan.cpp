@@ -0,0 +1,393 @@
+#include <iostream>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#include "pmap.h"
+
+using namespace std;
+
+// A piece of a memory region scanned by a single worker
+struct ScanChunk {
+    size_t region_idx;
+    u64 first_VPN;
+    u64 n_pages;
+    u64 huge_pages;  // Pages per hugetlb page of the region, 1 for other regions
+};
+
+// Per-worker scratch buffers, reused across chunks
+struct ScanBuffers {
+    vector<uint64_t> pagemap_buf;
+    vector<PagemapRun> runs;
+    vector<page_region> present;
+};
+
+// Append a contiguous region to the run list, histogram is counted after stitching
+static void append_region(ScanResult &res, u64 v_start, u64 p_start, u64 size) {
+    res.region_starts_V.push_back(v_start);
+    res.region_lengths.push_back(size);
+    res.region_starts_P.push_back(p_start);
+}
+
+// =================================================================================================
+// Find the contiguous regions of [chunk.first_VPN, chunk.first_VPN + chunk.n_pages)
+//  - Pagemap entries are read in bulk, PAGEMAP_CHUNK_PAGES at a time, and split into runs of
+//    consecutive PFNs by the vectorized run finder. Huge pages and large folios of any size show up
+//    as runs, so no kpageflags lookup is needed.
+//  - Pages mapped by a huge page table entry are physically contiguous and aligned to the huge page
+//    size, so only the entry of their first page is read: every page of a hugetlb region, and PMD-
+//    mapped THPs that PAGEMAP_SCAN reports with PAGE_IS_HUGE. A 1 GB hugetlb page costs one entry.
+//    Smaller folios are mapped page by page and may be partly mapped, their entries are all read.
+//  - With PAGEMAP_SCAN, only the entries of present ranges are read. Gaps end the current region
+//    like absent pages do.
+//  - A region still open at the end of the chunk is recorded, the caller stitches it to the next
+//    chunk of the same memory region.
+// =================================================================================================
+static bool scan_chunk(const ScanChunk &chunk, int pagemap_fd, bool use_scan, ScanBuffers &bufs, ScanResult &res) {
+    size_t pageSize = sysconf(_SC_PAGE_SIZE);
+    pagemap_run_finder find_runs = get_run_finder();
+    // Pages mapped by a PMD, one page table of entries
+    u64 pmd_pages = pageSize / sizeof(uint64_t);
+    u64 last_VPN = 0;
+    u64 last_PFN = 0;
+    u64 region_size = 0;
+
+    // n pages mapped from VPN to consecutive frames from PFN, PFN 0 for absent pages
+    auto add_pages = [&](u64 VPN, u64 PFN, u64 n) {
+        // Check if mapping is valid
+        if (PFN == 0) {
+            if (region_size > 0) {
+                append_region(res, last_VPN - region_size + 1, last_PFN - region_size + 1, region_size);
+                region_size = 0;
+            }
+            return;
+        }
+
+        // Continues contiguous region
+        if (VPN == last_VPN + 1 && PFN == last_PFN + 1) {
+            region_size += n;
+        }
+        // New region started
+        else {
+            if (region_size > 0) {
+                append_region(res, last_VPN - region_size + 1, last_PFN - region_size + 1, region_size);
+            }
+            region_size = n;
+        }
+        last_VPN = VPN + n - 1;
+        last_PFN = PFN + n - 1;
+    };
+
+    auto scan_pages = [&](u64 first_VPN, u64 n_pages) {
+        for (u64 offset = 0; offset < n_pages; offset += PAGEMAP_CHUNK_PAGES) {
+            // =================================================================
+            // Get virtual to physical mappings
+            // =================================================================
+            size_t count = min((u64) PAGEMAP_CHUNK_PAGES, n_pages - offset);
+            ssize_t n_read = pagemap_read_range(bufs.pagemap_buf.data(), (first_VPN + offset) * pageSize, count, pagemap_fd);
+            if (n_read != (ssize_t) count) {
+                return false;
+            }
+
+            // =================================================================
+            // Analyze contiguity
+            // =================================================================
+            // Unmapped pages between runs end the current region
+            size_t n_runs = find_runs(bufs.pagemap_buf.data(), count, bufs.runs.data());
+            size_t next = 0;
+            for (size_t r = 0; r < n_runs; r++) {
+                const PagemapRun &run = bufs.runs[r];
+                if (run.offset != next) {
+                    add_pages(first_VPN + offset + next, 0, 1);
+                }
+                add_pages(first_VPN + offset + run.offset, run.PFN, run.length);
+                next = run.offset + run.length;
+            }
+            if (next != count) {
+                add_pages(first_VPN + offset + next, 0, 1);
+            }
+        }
+        return true;
+    };
+
+    // One entry per huge page of huge_pages pages, the range may start or end inside a huge page
+    auto scan_huge_pages = [&](u64 first_VPN, u64 n_pages, u64 huge_pages) {
+        u64 end_VPN = first_VPN + n_pages;
+        for (u64 VPN = first_VPN; VPN < end_VPN;) {
+            u64 n = min(huge_pages - VPN % huge_pages, end_VPN - VPN);
+            uint64_t entry;
+            if (pagemap_read_range(&entry, VPN * pageSize, 1, pagemap_fd) != 1) {
+                return false;
+            }
+            add_pages(VPN, PM_PRESENT(entry) ? PM_PFN(entry) : 0, n);
+            VPN += n;
+        }
+        return true;
+    };
+
+    bool ok = true;
+    if (use_scan) {
+        uintptr_t addr = chunk.first_VPN * pageSize;
+        uintptr_t chunk_end = (chunk.first_VPN + chunk.n_pages) * pageSize;
+        while (ok && addr < chunk_end) {
+            uintptr_t walk_end;
+            long n = pagemap_scan_present(bufs.present.data(), bufs.present.size(), addr, chunk_end, &walk_end, pagemap_fd);
+            if (n < 0) {
+                return false;
+            }
+            for (long r = 0; r < n && ok; r++) {
+                u64 first_VPN = bufs.present[r].start / pageSize;
+                u64 n_pages = (bufs.present[r].end - bufs.present[r].start) / pageSize;
+                if (bufs.present[r].categories & PAGE_IS_HUGE) {
+                    ok = scan_huge_pages(first_VPN, n_pages, chunk.huge_pages > 1 ? chunk.huge_pages : pmd_pages);
+                }
+                else {
+                    ok = scan_pages(first_VPN, n_pages);
+                }
+            }
+            addr = walk_end;
+        }
+    }
+    else if (chunk.huge_pages > 1) {
+        ok = scan_huge_pages(chunk.first_VPN, chunk.n_pages, chunk.huge_pages);
+    }
+    else {
+        ok = scan_pages(chunk.first_VPN, chunk.n_pages);
+    }
+
+    // Region still open at the end of the chunk
+    if (ok && region_size > 0) {
+        append_region(res, last_VPN - region_size + 1, last_PFN - region_size + 1, region_size);
+    }
+    return ok;
+}
+
+// Count the total pages and power-of-2 regions of a run list, each worker takes an even share of it
+static void count_regions(ScanResult &result, int n_threads) {
+    result.n_regions = result.region_lengths.size();
+    for (u64 size : result.region_lengths) {
+        result.total_pages += size;
+    }
+
+    size_t n_runs = result.region_lengths.size();
+    int n_counters = min((size_t) n_threads, max(n_runs, (size_t) 1));
+    pow2_counter counter = get_pow2_counter(require_alignment, max_order);
+    vector<vector<u64>> partial(n_counters, vector<u64>(CONT_MAX_ORDER - CONT_LOWEST + 1, 0));
+    run_workers(n_counters, [&](int t) {
+        size_t begin = n_runs * t / n_counters;
+        size_t end = n_runs * (t + 1) / n_counters;
+        counter(result.region_starts_P.data() + begin, result.region_starts_V.data() + begin,
+                result.region_lengths.data() + begin, end - begin, partial[t].data());
+    });
+    for (const auto &p : partial) {
+        for (int i = 0; i <= CONT_MAX_ORDER - CONT_LOWEST; i++) {
+            result.power2_regions[i] += p[i];
+        }
+    }
+}
+
+// =================================================================================================
+// Scan budget
+//  - The budget is checked after every unit of work: the pacer sleeps until the CPU time used so
+//    far is at most max_cpu_pct of the wall time, and the pages walked so far took at least
+//    1 / pages_per_ms milliseconds each
+//  - CPU time is that of the whole process, user and system, so the kernel's pagemap walk counts
+//  - Workers sleep until an absolute deadline, so they all wake up together
+// =================================================================================================
+static double timespec_ms(const struct timespec &t) {
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static double clock_ms(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return timespec_ms(now);
+}
+
+ScanPacer::ScanPacer(const ScanBudget &budget) : budget(budget) {
+    clock_gettime(CLOCK_MONOTONIC, &start_wall);
+    start_cpu_ms = clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+double ScanPacer::span_ms() const {
+    return clock_ms(CLOCK_MONOTONIC) - timespec_ms(start_wall);
+}
+
+double ScanPacer::cpu_ms() const {
+    return clock_ms(CLOCK_PROCESS_CPUTIME_ID) - start_cpu_ms;
+}
+
+void ScanPacer::throttle(u64 n_pages) {
+    u64 done = pages += n_pages;
+    double target_ms = 0;
+    if (budget.max_cpu_pct > 0) {
+        target_ms = cpu_ms() * 100 / budget.max_cpu_pct;
+    }
+    if (budget.pages_per_ms > 0) {
+        target_ms = max(target_ms, done / budget.pages_per_ms);
+    }
+    if (target_ms <= span_ms()) {
+        return;
+    }
+    u64 target_ns = (u64) (target_ms * 1e6) + start_wall.tv_nsec;
+    struct timespec deadline = {start_wall.tv_sec + (time_t) (target_ns / 1000000000), (long) (target_ns % 1000000000)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+}
+
+// =================================================================================================
+// Scan the given memory regions for contiguous virtual to physical mappings
+//  - Regions are split into chunks of at most SCAN_CHUNK_PAGES pages, handed out to n_threads
+//    workers. Each chunk produces its own run list.
+//  - With a pacer, chunks are BUDGET_CHUNK_PAGES (or one huge page) instead, and workers check the
+//    budget after each one. Each chunk is a bounded pagemap read, between them the target's mm
+//    locks are free.
+//  - Run lists are concatenated in region order, stitching regions that cross chunk boundaries,
+//    so the result is identical to a serial scan.
+//  - Power-of-2 counts are then computed in parallel over the stitched run list and summed.
+// =================================================================================================
+bool scan_regions(const vector<MemoryRegion> &regions, int pagemap_fd, bool use_scan, int n_threads, ScanResult &result,
+                  ScanPacer *pacer) {
+    size_t pageSize = sysconf(_SC_PAGE_SIZE);
+    n_threads = max(n_threads, 1);
+
+    // Split regions into chunks
+    vector<ScanChunk> chunks;
+    for (size_t r = 0; r < regions.size(); r++) {
+        u64 first_VPN = regions[r].address / pageSize;
+        u64 n_pages = regions[r].size / pageSize;
+        u64 huge_pages = max(regions[r].kernel_page_size / pageSize, (size_t) 1);
+        u64 chunk_pages = pacer ? max((u64) BUDGET_CHUNK_PAGES, huge_pages) : SCAN_CHUNK_PAGES;
+        for (u64 offset = 0; offset < n_pages; offset += chunk_pages) {
+            chunks.push_back({r, first_VPN + offset, min(chunk_pages, n_pages - offset), huge_pages});
+        }
+    }
+
+    // Scan chunks, workers pull the next unscanned chunk
+    vector<ScanResult> chunk_results(chunks.size());
+    atomic<size_t> next_chunk(0);
+    atomic<bool> failed(false);
+    run_workers(min((size_t) n_threads, max(chunks.size(), (size_t) 1)), [&](int) {
+        ScanBuffers bufs;
+        bufs.pagemap_buf.resize(PAGEMAP_CHUNK_PAGES);
+        bufs.runs.resize(PAGEMAP_CHUNK_PAGES + 1);
+        bufs.present.resize(use_scan ? PAGEMAP_SCAN_VEC_LEN : 0);
+        size_t c;
+        while (!failed && (c = next_chunk++) < chunks.size()) {
+            if (!scan_chunk(chunks[c], pagemap_fd, use_scan, bufs, chunk_results[c])) {
+                failed = true;
+            }
+            else if (pacer) {
+                pacer->throttle(chunks[c].n_pages);
+            }
+        }
+    });
+    if (failed) {
+        return false;
+    }
+
+    // Concatenate run lists, merging regions that continue into the next chunk of the same memory region
+    result.region_first_run.assign(regions.size() + 1, 0);
+    for (size_t c = 0; c < chunks.size(); c++) {
+        ScanResult &part = chunk_results[c];
+        if (c == 0 || chunks[c].region_idx != chunks[c - 1].region_idx) {
+            result.region_first_run[chunks[c].region_idx] = result.region_lengths.size();
+        }
+        size_t first = 0;
+        if (c > 0 && chunks[c].region_idx == chunks[c - 1].region_idx &&
+                !part.region_lengths.empty() && !result.region_lengths.empty()) {
+            u64 &last_size = result.region_lengths.back();
+            if (result.region_starts_V.back() + last_size == part.region_starts_V[0] &&
+                    result.region_starts_P.back() + last_size == part.region_starts_P[0]) {
+                last_size += part.region_lengths[0];
+                first = 1;
+            }
+        }
+        result.region_starts_V.insert(result.region_starts_V.end(), part.region_starts_V.begin() + first, part.region_starts_V.end());
+        result.region_lengths.insert(result.region_lengths.end(), part.region_lengths.begin() + first, part.region_lengths.end());
+        result.region_starts_P.insert(result.region_starts_P.end(), part.region_starts_P.begin() + first, part.region_starts_P.end());
+        part = ScanResult();
+    }
+    // Regions without chunks have no runs, every region ends where the next one starts
+    result.region_first_run[regions.size()] = result.region_lengths.size();
+    for (size_t r = regions.size(); r-- > 0;) {
+        if (regions[r].size / pageSize == 0) {
+            result.region_first_run[r] = result.region_first_run[r + 1];
+        }
+    }
+    count_regions(result, n_threads);
+    return true;
+}
+
+// =================================================================================================
+// Combine the scans of several processes, counting every physical frame once
+//  - Frames mapped more than once (shared memory, shared file pages, pages shared after fork) would
+//    otherwise be counted once per mapping
+//  - Runs are visited in PFN order and cut down to the frames no earlier run covers. The remainder
+//    keeps its virtual offset, so aligned counting still applies.
+//  - shared_pages[i] is the number of frames of scans[i] that are mapped more than once
+//  - Returns the number of distinct frames mapped more than once
+// =================================================================================================
+u64 merge_scans(const vector<const ScanResult *> &scans, int n_threads, ScanResult &result, vector<u64> &shared_pages) {
+    struct FrameRun {
+        u64 PFN;
+        u64 VPN;
+        u64 length;
+        size_t owner;
+    };
+    n_threads = max(n_threads, 1);
+    vector<FrameRun> runs;
+    for (size_t s = 0; s < scans.size(); s++) {
+        for (size_t i = 0; i < scans[s]->region_lengths.size(); i++) {
+            runs.push_back({scans[s]->region_starts_P[i], scans[s]->region_starts_V[i], scans[s]->region_lengths[i], s});
+        }
+    }
+    sort(runs.begin(), runs.end(), [](const FrameRun &a, const FrameRun &b) { return a.PFN < b.PFN; });
+
+    // Frames covered by a single run belong to that run's scan alone, everything else is shared
+    //  - Sweep over run starts and ends in PFN order. While exactly one run is active, the sum of the
+    //    active owners is that run's owner.
+    struct Event {
+        u64 PFN;
+        int delta;
+        size_t owner;
+    };
+    vector<Event> events;
+    events.reserve(runs.size() * 2);
+    for (const auto &run : runs) {
+        events.push_back({run.PFN, 1, run.owner});
+        events.push_back({run.PFN + run.length, -1, run.owner});
+    }
+    sort(events.begin(), events.end(), [](const Event &a, const Event &b) { return a.PFN < b.PFN; });
+    vector<u64> unique_pages(scans.size(), 0);
+    u64 shared_frames = 0;
+    u64 active = 0, active_owners = 0, last_PFN = 0;
+    for (const auto &event : events) {
+        if (active == 1) {
+            unique_pages[active_owners] += event.PFN - last_PFN;
+        }
+        else if (active > 1) {
+            shared_frames += event.PFN - last_PFN;
+        }
+        active += event.delta;
+        active_owners += event.delta * event.owner;
+        last_PFN = event.PFN;
+    }
+    shared_pages.assign(scans.size(), 0);
+    for (size_t s = 0; s < scans.size(); s++) {
+        shared_pages[s] = scans[s]->total_pages - unique_pages[s];
+    }
+
+    // Keep the frames of each run that no earlier run covers
+    u64 covered_end = 0;
+    for (const auto &run : runs) {
+        u64 start = max(run.PFN, covered_end);
+        if (start >= run.PFN + run.length) {
+            continue;
+        }
+        u64 skip = start - run.PFN;
+        append_region(result, run.VPN + skip, start, run.length - skip);
+        covered_end = run.PFN + run.length;
+    }
+    count_regions(result, n_threads);
+    return shared_frames;
+}
@@ -0,0 +1,323 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <numeric>
+#include <iterator>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pmap.h"
+
+using namespace std;
+
+// =================================================================================================
+// Binary snapshot layout (all integers little endian)
+//  - Header:  SnapshotHeader
+//  - Blocks:  runs sorted by VPN, SNAPSHOT_BLOCK_RUNS per block, each run as three LEB128 varints
+//               VPN - end VPN of the previous run   (runs never overlap, so never negative)
+//               zigzag(PFN - end PFN of the previous run)
+//               length
+//             The previous run of the first run in a block is (0, 0, 0), so blocks decode on their own
+//  - Index:   one SnapshotIndexEntry per block
+//  - Trailer: SnapshotTrailer, at the very end of the file
+// =================================================================================================
+static const char SNAPSHOT_MAGIC[8] = {'P', 'M', 'A', 'P', 'S', 'N', 'A', 'P'};
+static const char SNAPSHOT_INDEX_MAGIC[8] = {'P', 'M', 'A', 'P', 'I', 'D', 'X', '\0'};
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_runs;
+    uint64_t n_runs;
+    uint64_t total_pages;
+};
+
+struct SnapshotIndexEntry {
+    uint64_t first_VPN;
+    uint64_t offset;
+};
+
+struct SnapshotTrailer {
+    uint64_t index_offset;
+    uint64_t n_blocks;
+    char magic[8];
+};
+
+static inline void put_varint(vector<uint8_t> &buf, u64 value) {
+    while (value >= 0x80) {
+        buf.push_back((uint8_t) value | 0x80);
+        value >>= 7;
+    }
+    buf.push_back((uint8_t) value);
+}
+
+// Decode a varint, stopping at end so a corrupt block cannot read past the block area
+static inline u64 get_varint(const uint8_t *&p, const uint8_t *end) {
+    u64 value = 0;
+    for (int shift = 0; p < end; shift += 7) {
+        uint8_t byte = *p++;
+        if (shift < 64) {
+            value |= (u64) (byte & 0x7f) << shift;
+        }
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    return value;
+}
+
+static inline u64 zigzag(int64_t value) {
+    return ((u64) value << 1) ^ (u64) (value >> 63);
+}
+
+static inline int64_t unzigzag(u64 value) {
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+template <typename T>
+static void put_struct(vector<uint8_t> &buf, const T &value) {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&value);
+    buf.insert(buf.end(), bytes, bytes + sizeof(T));
+}
+
+// Write n runs to path in the binary snapshot format, runs are sorted by VPN on the way out
+bool write_snapshot(const string &path, const u64 *starts_V, const u64 *starts_P, const u64 *lengths, size_t n) {
+    vector<size_t> order(n);
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&](size_t a, size_t b) { return starts_V[a] < starts_V[b]; });
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.block_runs = SNAPSHOT_BLOCK_RUNS;
+    header.n_runs = n;
+
+    vector<uint8_t> buf;
+    buf.reserve(sizeof(header) + n * 6);
+    put_struct(buf, header);
+    vector<SnapshotIndexEntry> index;
+    u64 prev_VPN_end = 0, prev_PFN_end = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t r = order[i];
+        if (i % SNAPSHOT_BLOCK_RUNS == 0) {
+            index.push_back({starts_V[r], buf.size()});
+            prev_VPN_end = prev_PFN_end = 0;
+        }
+        put_varint(buf, starts_V[r] - prev_VPN_end);
+        put_varint(buf, zigzag((int64_t) (starts_P[r] - prev_PFN_end)));
+        put_varint(buf, lengths[r]);
+        prev_VPN_end = starts_V[r] + lengths[r];
+        prev_PFN_end = starts_P[r] + lengths[r];
+        header.total_pages += lengths[r];
+    }
+    memcpy(buf.data() + offsetof(SnapshotHeader, total_pages), &header.total_pages, sizeof(header.total_pages));
+
+    SnapshotTrailer trailer = {buf.size(), index.size(), {}};
+    memcpy(trailer.magic, SNAPSHOT_INDEX_MAGIC, sizeof(trailer.magic));
+    for (const auto &entry : index) {
+        put_struct(buf, entry);
+    }
+    put_struct(buf, trailer);
+
+    ofstream out(path, ios::binary | ios::trunc);
+    if (!out.is_open()) {
+        return false;
+    }
+    out.write(reinterpret_cast<const char *>(buf.data()), buf.size());
+    return out.good();
+}
+
+// Check whether path starts with the binary snapshot magic
+bool is_snapshot(const string &path) {
+    ifstream in(path, ios::binary);
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    return in.read(magic, sizeof(magic)) && memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+}
+
+// Parse the hex field at p and move p past it
+//  - strtoull alone skips leading whitespace, newlines included, and reads an empty field as 0
+static bool parse_hex_field(const char *&p, u64 &value) {
+    if (!isxdigit((unsigned char) *p)) {
+        return false;
+    }
+    char *next;
+    value = strtoull(p, &next, 16);
+    p = next;
+    return true;
+}
+
+// Load the runs of a snapshot, binary or the VPN,PFN,Size[,VMA] text written by dump_pagemap
+//  - Runs are returned sorted by VPN
+bool load_runs(const string &path, vector<SnapshotRun> &runs) {
+    runs.clear();
+    if (is_snapshot(path)) {
+        SnapshotReader reader;
+        if (!reader.open(path)) {
+            return false;
+        }
+        runs.reserve(reader.size());
+        for (const auto &run : reader) {
+            runs.push_back(run);
+        }
+        return true;
+    }
+
+    ifstream in(path, ios::binary);
+    if (!in.is_open()) {
+        cerr << "Failed to open file " << path << endl;
+        return false;
+    }
+    string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+    // Skip the header line, then parse "vpn,pfn,size" lines in place, ignoring any further columns
+    //  - Size must end its line or be followed by ','
+    const char *p = text.c_str();
+    const char *end = p + text.size();
+    p = (const char *) memchr(p, '\n', end - p);
+    for (size_t line = 2; p && p + 1 < end; line++) {
+        const char *field = p + 1;
+        SnapshotRun run;
+        if (!parse_hex_field(field, run.VPN) || *field++ != ',' || !parse_hex_field(field, run.PFN) ||
+            *field++ != ',' || !parse_hex_field(field, run.length) ||
+            (field != end && *field != '\n' && *field != ',')) {
+            cerr << path << ":" << line << ": expected VPN,PFN,Size in hex\n";
+            runs.clear();
+            return false;
+        }
+        runs.push_back(run);
+        p = (const char *) memchr(field, '\n', end - field);
+    }
+    sort(runs.begin(), runs.end(), [](const SnapshotRun &a, const SnapshotRun &b) { return a.VPN < b.VPN; });
+    return true;
+}
+
+// =================================================================================================
+// SnapshotReader
+// =================================================================================================
+SnapshotReader::~SnapshotReader() {
+    unmap();
+}
+
+void SnapshotReader::unmap() {
+    if (data) {
+        munmap((void *) data, length);
+    }
+    data = nullptr;
+    length = 0;
+    n_runs = n_pages = 0;
+    block_runs = 1;
+    blocks_end = nullptr;
+    index.clear();
+}
+
+// Map a binary snapshot and read its index
+//  - The header, trailer and index are checked against the file size before anything is read
+//    through them, and every block must start inside the block area, which varints are decoded
+//    within (see Iterator::decode). Every run takes at least 3 bytes, which bounds n_runs
+//  - A snapshot already open is closed first, and nothing stays mapped on failure
+bool SnapshotReader::open(const string &path) {
+    unmap();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror("open snapshot");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(SnapshotHeader) + sizeof(SnapshotTrailer)) {
+        cerr << "Snapshot " << path << " is truncated\n";
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap snapshot");
+        return false;
+    }
+    data = (const uint8_t *) map;
+    length = st.st_size;
+
+    SnapshotHeader header;
+    SnapshotTrailer trailer;
+    memcpy(&header, data, sizeof(header));
+    memcpy(&trailer, data + length - sizeof(trailer), sizeof(trailer));
+    // Index and trailer fill the end of the file exactly, checked without overflowing
+    size_t index_end = length - sizeof(trailer);
+    bool valid = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 && header.version == SNAPSHOT_VERSION &&
+            memcmp(trailer.magic, SNAPSHOT_INDEX_MAGIC, sizeof(trailer.magic)) == 0 &&
+            trailer.index_offset >= sizeof(header) && trailer.index_offset <= index_end &&
+            (index_end - trailer.index_offset) % sizeof(SnapshotIndexEntry) == 0 &&
+            (index_end - trailer.index_offset) / sizeof(SnapshotIndexEntry) == trailer.n_blocks &&
+            header.block_runs != 0 && header.n_runs <= (trailer.index_offset - sizeof(header)) / 3 &&
+            trailer.n_blocks == header.n_runs / header.block_runs + (header.n_runs % header.block_runs != 0);
+    if (valid) {
+        index.resize(trailer.n_blocks);
+        for (size_t b = 0; b < index.size() && valid; b++) {
+            SnapshotIndexEntry entry;
+            memcpy(&entry, data + trailer.index_offset + b * sizeof(entry), sizeof(entry));
+            index[b] = {entry.first_VPN, entry.offset};
+            valid = entry.offset >= sizeof(header) && entry.offset < trailer.index_offset;
+        }
+    }
+    if (!valid) {
+        cerr << "Snapshot " << path << " is not a valid snapshot\n";
+        unmap();
+        return false;
+    }
+    n_runs = header.n_runs;
+    n_pages = header.total_pages;
+    block_runs = header.block_runs;
+    blocks_end = data + trailer.index_offset;
+    return true;
+}
+
+SnapshotReader::Iterator SnapshotReader::begin() const {
+    return Iterator(this, 0);
+}
+
+SnapshotReader::Iterator SnapshotReader::end() const {
+    return Iterator(this, n_runs);
+}
+
+// First run that contains vpn or starts after it
+SnapshotReader::Iterator SnapshotReader::seek(u64 vpn) const {
+    // Last block starting at or before vpn
+    auto it = upper_bound(index.begin(), index.end(), vpn, [](u64 v, const std::pair<u64, u64> &e) { return v < e.first; });
+    size_t block = it == index.begin() ? 0 : (it - index.begin()) - 1;
+    Iterator run(this, block * block_runs);
+    while (run != end() && run->VPN + run->length <= vpn) {
+        ++run;
+    }
+    return run;
+}
+
+SnapshotReader::Iterator::Iterator(const SnapshotReader *reader, u64 idx) : reader(reader), idx(idx) {
+    // Iterators start on a block boundary, where decode finds the block in the index
+    if (idx < reader->n_runs) {
+        decode();
+    }
+}
+
+// Decode run idx, each block restarts at its index offset so a corrupt block does not shift the next
+void SnapshotReader::Iterator::decode() {
+    if (idx % reader->block_runs == 0) {
+        run = {0, 0, 0};
+        p = reader->data + reader->index[idx / reader->block_runs].second;
+    }
+    const uint8_t *end = reader->blocks_end;
+    u64 VPN = run.VPN + run.length + get_varint(p, end);
+    u64 PFN = run.PFN + run.length + unzigzag(get_varint(p, end));
+    run = {VPN, PFN, get_varint(p, end)};
+}
+
+SnapshotReader::Iterator &SnapshotReader::Iterator::operator++() {
+    if (++idx < reader->n_runs) {
+        decode();
+    }
+    return *this;
+}
@@ -0,0 +1,140 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "pmap.h"
+
+using namespace std;
+
+// Total entries of a model
+u64 TlbModel::n_entries() const {
+    u64 n = 0;
+    for (const auto &e : entries) {
+        n += e.second;
+    }
+    return n;
+}
+
+// Pages covered by the capacity entries covering the most pages
+u64 TlbModel::reach(u64 capacity) const {
+    u64 pages = 0;
+    for (const auto &e : entries) {
+        u64 n = min(capacity, e.second);
+        pages += n * e.first;
+        capacity -= n;
+        if (capacity == 0) break;
+    }
+    return pages;
+}
+
+// Entry sizes of a histogram indexed by pages per entry, largest first
+static vector<pair<u64, u64>> from_histogram(const vector<u64> &histogram) {
+    vector<pair<u64, u64>> entries;
+    for (size_t size = histogram.size(); size-- > 1;) {
+        if (histogram[size] > 0) {
+            entries.push_back({size, histogram[size]});
+        }
+    }
+    return entries;
+}
+
+// =================================================================================================
+// Page table entries of the given page orders
+//  - A page of order k maps 2^k pages aligned to 2^k in both the virtual and physical address
+//    space, so it is only usable where VPN - PFN is a multiple of 2^k
+//  - Each run takes the largest usable pages first: of the blocks_k aligned order-k blocks inside
+//    the run, the pages already covered by larger pages are subtracted, and 4K pages cover the rest
+// =================================================================================================
+static TlbModel page_size_model(const string &name, const vector<SnapshotRun> &runs, const vector<int> &orders) {
+    u64 counts[CONT_MAX_ORDER + 1] = {0};
+    for (const auto &run : runs) {
+        u64 start = run.VPN;
+        u64 end = run.VPN + run.length;
+        u64 covered = 0;
+        for (int order : orders) {
+            u64 size = (u64) 1 << order;
+            if ((run.VPN - run.PFN) & (size - 1)) continue;
+            u64 first = (start + size - 1) >> order;
+            u64 last = end >> order;
+            if (last <= first) continue;
+            u64 blocks = last - first;
+            counts[order] += blocks - (covered >> order);
+            covered = blocks << order;
+        }
+        counts[0] += run.length - covered;
+    }
+    TlbModel model = {name, {}};
+    for (int order = CONT_MAX_ORDER; order >= 0; order--) {
+        if (counts[order] > 0) {
+            model.entries.push_back({(u64) 1 << order, counts[order]});
+        }
+    }
+    return model;
+}
+
+// =================================================================================================
+// Coalescing TLB: one entry maps the pages of an aligned group of ways virtual pages that are
+// contiguous in physical memory, with no physical alignment required
+//  - ways is a power of 2, as groups are selected by the low bits of the VPN
+//  - A run touching g groups takes g entries, one per group, sized by its overlap with the group
+// =================================================================================================
+static TlbModel coalescing_model(const vector<SnapshotRun> &runs, int ways) {
+    int shift = __builtin_ctz(ways);
+    vector<u64> histogram(ways + 1, 0);
+    for (const auto &run : runs) {
+        u64 start = run.VPN;
+        u64 end = run.VPN + run.length;
+        u64 first_group = start >> shift;
+        u64 last_group = (end - 1) >> shift;
+        if (first_group == last_group) {
+            histogram[run.length]++;
+            continue;
+        }
+        histogram[((first_group + 1) << shift) - start]++;
+        histogram[end - (last_group << shift)]++;
+        histogram[ways] += last_group - first_group - 1;
+    }
+    return {to_string(ways) + "-way coalescing", from_histogram(histogram)};
+}
+
+// Range translations: one entry per run, of any length and alignment
+//  - Lengths below RANGE_HISTOGRAM_PAGES are counted in a histogram, only longer runs are sorted
+#define RANGE_HISTOGRAM_PAGES (1 << 16)
+static TlbModel range_model(const vector<SnapshotRun> &runs) {
+    vector<u64> histogram(RANGE_HISTOGRAM_PAGES, 0);
+    vector<u64> lengths;
+    for (const auto &run : runs) {
+        if (run.length < RANGE_HISTOGRAM_PAGES) {
+            histogram[run.length]++;
+        } else {
+            lengths.push_back(run.length);
+        }
+    }
+    sort(lengths.begin(), lengths.end(), greater<u64>());
+    TlbModel model = {"range", {}};
+    for (u64 length : lengths) {
+        if (!model.entries.empty() && model.entries.back().first == length) {
+            model.entries.back().second++;
+        } else {
+            model.entries.push_back({length, 1});
+        }
+    }
+    vector<pair<u64, u64>> short_entries = from_histogram(histogram);
+    model.entries.insert(model.entries.end(), short_entries.begin(), short_entries.end());
+    return model;
+}
+
+// Translation entries needed to map runs under every model, runs as load_runs returns them
+//  - 4K, 4K+2M, 4K+2M+1G page tables, one coalescing TLB per entry of coalesce_ways, range translations
+vector<TlbModel> tlb_models(const vector<SnapshotRun> &runs, const vector<int> &coalesce_ways) {
+    vector<TlbModel> models;
+    models.push_back(page_size_model("4K", runs, {}));
+    models.push_back(page_size_model("4K+2M", runs, {9}));
+    models.push_back(page_size_model("4K+2M+1G", runs, {18, 9}));
+    for (int ways : coalesce_ways) {
+        models.push_back(coalescing_model(runs, ways));
+    }
+    models.push_back(range_model(runs));
+    return models;
+}
@@ -0,0 +1,215 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pmap.h"
+
+using namespace std;
+
+// Comma separated list of powers of 2
+static bool parse_ways(const string &list, vector<int> &values)
+{
+    istringstream in(list);
+    string value;
+    while (getline(in, value, ',')) {
+        if (value.empty() || value.size() > 9 || value.find_first_not_of("0123456789") != string::npos ||
+                stoi(value) < 1 || (stoi(value) & (stoi(value) - 1))) {
+            cerr << "Invalid coalescing group size: " << value << endl;
+            return false;
+        }
+        values.push_back(stoi(value));
+    }
+    return true;
+}
+
+// "<sets>x<ways>" TLB geometry, sets a power of 2
+static bool parse_geometry(const string &value, TlbGeometry &geometry)
+{
+    size_t x = value.find('x');
+    if (x == string::npos || value.find_first_not_of("0123456789x") != string::npos || x == 0 || x + 1 == value.size() ||
+            value.size() > 12) {
+        cerr << "Invalid TLB geometry: " << value << endl;
+        return false;
+    }
+    geometry.sets = stoi(value.substr(0, x));
+    geometry.ways = stoi(value.substr(x + 1));
+    if (geometry.sets < 1 || (geometry.sets & (geometry.sets - 1)) || geometry.ways < 1) {
+        cerr << "Invalid TLB geometry: " << value << " (sets must be a power of 2)\n";
+        return false;
+    }
+    return true;
+}
+
+// Virtual addresses of a binary trace, native 64-bit integers
+static const uint64_t *map_trace(const string &path, size_t &n)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror("open trace");
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(uint64_t)) {
+        cerr << "Empty or unreadable trace " << path << endl;
+        close(fd);
+        return nullptr;
+    }
+    // Populated up front, so the replay does not take a page fault every 512 accesses
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap trace");
+        return nullptr;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    n = st.st_size / sizeof(uint64_t);
+    return (const uint64_t *) data;
+}
+
+// Translation entries needed to map the runs of a snapshot written by dump_pagemap (text or --binary)
+// - One CSV row per model: entries to map every tracked page, pages reached by the TLB capacity
+//   entries covering the most memory, and the share of the tracked RSS they reach
+// - --capacity: TLB entries, 1536 by default (a second level TLB)
+// - --coalesce: group sizes of the coalescing TLBs (powers of 2), 8,16,32 by default
+// With --dist <file> or --trace <file>, also replays accesses through a TLB per model and adds
+// "Accesses,Misses,Miss-Rate" to every row (see tlb_sim.cpp)
+// - --dist: page access histogram, "<hex address> <count>" lines, --accesses are drawn from it
+// - --trace: binary file of 64-bit virtual addresses, replayed in order
+// - --tlb: geometry of the page and coalescing TLBs, 128x12 by default; --range-entries: size of
+//   the fully associative range TLB, 32 by default
+// - -j: shards simulated in parallel, each with its own TLBs, as one core per shard
+int main(int argc, char **argv)
+{
+    u64 capacity = 1536;
+    vector<int> coalesce_ways;
+    string file;
+    string dist_file, trace_file;
+    u64 n_accesses = 100000000;
+    u64 seed = 42;
+    TlbGeometry geometry;
+    int n_threads = 1;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--dist" && i + 1 < argc) {
+            dist_file = argv[++i];
+        }
+        else if (arg == "--trace" && i + 1 < argc) {
+            trace_file = argv[++i];
+        }
+        else if (arg == "--accesses" && i + 1 < argc) {
+            long long n = stoll(argv[++i]);
+            if (n < 1) {
+                cerr << "Invalid number of accesses: " << n << endl;
+                return EXIT_FAILURE;
+            }
+            n_accesses = n;
+        }
+        else if (arg == "--seed" && i + 1 < argc) {
+            seed = stoull(argv[++i]);
+        }
+        else if (arg == "--tlb" && i + 1 < argc) {
+            if (!parse_geometry(argv[++i], geometry)) {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--range-entries" && i + 1 < argc) {
+            geometry.range_entries = stoi(argv[++i]);
+            if (geometry.range_entries < 1) {
+                cerr << "Invalid number of range entries: " << geometry.range_entries << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "-j" && i + 1 < argc) {
+            n_threads = stoi(argv[++i]);
+            if (n_threads < 1) {
+                cerr << "Invalid number of threads: " << n_threads << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--capacity" && i + 1 < argc) {
+            long long n = stoll(argv[++i]);
+            if (n < 1) {
+                cerr << "Invalid capacity: " << n << endl;
+                return EXIT_FAILURE;
+            }
+            capacity = n;
+        }
+        else if (arg == "--coalesce" && i + 1 < argc) {
+            if (!parse_ways(argv[++i], coalesce_ways)) {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (file.empty()) {
+            file = arg;
+        }
+        else {
+            file.clear();
+            break;
+        }
+    }
+    if (file.empty() || (!dist_file.empty() && !trace_file.empty())) {
+        cerr << "Usage: " << argv[0] << " <snapshot> [--capacity N] [--coalesce 8,16,32]\n";
+        cerr << "       " << argv[0] << " <snapshot> --dist <file> [--accesses N] [--seed N]|--trace <file> [--tlb SETSxWAYS] [--range-entries N] [-j threads] [options]\n";
+        return EXIT_FAILURE;
+    }
+    if (coalesce_ways.empty()) {
+        coalesce_ways = {8, 16, 32};
+    }
+
+    vector<SnapshotRun> runs;
+    if (!load_runs(file, runs)) {
+        return EXIT_FAILURE;
+    }
+    u64 total_pages = 0;
+    for (const auto &run : runs) {
+        total_pages += run.length;
+    }
+
+    // Replay accesses
+    vector<TlbSimResult> sim;
+    u64 untracked = 0;
+    bool simulate = !dist_file.empty() || !trace_file.empty();
+    auto t0 = chrono::steady_clock::now();
+    if (!dist_file.empty()) {
+        vector<pair<u64, u64>> histogram;
+        if (!load_access_histogram(dist_file, histogram)) {
+            return EXIT_FAILURE;
+        }
+        sim = simulate_histogram(runs, histogram, n_accesses, seed, coalesce_ways, geometry, n_threads, untracked);
+    }
+    else if (!trace_file.empty()) {
+        size_t n;
+        const uint64_t *trace = map_trace(trace_file, n);
+        if (!trace) {
+            return EXIT_FAILURE;
+        }
+        n_accesses = n;
+        sim = simulate_trace(runs, trace, n, coalesce_ways, geometry, n_threads, untracked);
+        munmap((void *) trace, n * sizeof(uint64_t));
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+    cout << "Model,Entries,Reach,Coverage" << (simulate ? ",Accesses,Misses,Miss-Rate" : "") << "\n" << fixed;
+    vector<TlbModel> models = tlb_models(runs, coalesce_ways);
+    for (size_t m = 0; m < models.size(); m++) {
+        u64 reach = models[m].reach(capacity);
+        cout << models[m].name << "," << models[m].n_entries() << "," << setprecision(3) << double(reach) * 4096 / 1024 / 1024 / 1024
+             << "GB," << setprecision(4) << (total_pages ? double(reach) / total_pages : 0);
+        if (simulate) {
+            cout << "," << sim[m].accesses << "," << sim[m].misses << "," << setprecision(6)
+                 << (sim[m].accesses ? double(sim[m].misses) / sim[m].accesses : 0);
+        }
+        cout << "\n";
+    }
+    cout << flush;
+    if (simulate) {
+        cerr << "Simulated " << n_accesses << " accesses (" << untracked << " outside the snapshot) on " << models.size()
+             << " models in " << setprecision(3) << seconds << " s, " << n_accesses * models.size() / seconds / 1e6
+             << " M model accesses/s\n";
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,481 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <immintrin.h>
+
+#include "pmap.h"
+
+using namespace std;
+
+// Accesses simulated per block, every model replays a block before the next one is generated
+#define SIM_BLOCK_ACCESSES 4096
+#define NO_RUN (~(size_t) 0)
+
+// An access to a tracked page, with what the models need to know of the run mapping it
+//  - run_VPN: first page of the run, identifies it
+//  - huge_order: largest page order (9 or 18) that is aligned in both address spaces and lies within
+//    the run around VPN, 0 if none
+struct SimAccess {
+    u64 VPN;
+    u64 run_VPN;
+    int huge_order;
+};
+
+// =================================================================================================
+// Set-associative TLB with LRU replacement
+//  - Tags of a set are kept in recency order in one flat array, a hit moves its tag to the front
+//    and a miss shifts the set and inserts at the front
+//  - A key selects its set by key >> index_shift, so lookups need nothing but the key
+//  - Sets are padded to whole 4-tag vectors. With AVX2, a lookup compares the set with the key and
+//    rotates it in vectors, without branches: hits land at unpredictable ways, and a branch on the
+//    way costs more than moving the whole set. Sets of up to 32 ways are kept in registers.
+// =================================================================================================
+#define SIM_MAX_VECTOR_WAYS 32
+
+class SetAssocTlb {
+public:
+    SetAssocTlb(int sets, int ways, int index_shift)
+            : mask(sets - 1), ways(ways), stride((ways + 3) / 4 * 4), index_shift(index_shift),
+              storage((size_t) sets * stride + 4, ~(u64) 0) {
+        // 32-byte aligned sets, as an offset so the TLB can be moved
+        offset = (-(uintptr_t) storage.data() / sizeof(u64)) & 3;
+        replay_keys = &SetAssocTlb::replay_scalar;
+        if (ways <= SIM_MAX_VECTOR_WAYS && __builtin_cpu_supports("avx2")) {
+            switch (stride / 4) {
+            case 1: replay_keys = &SetAssocTlb::replay_avx2<1>; break;
+            case 2: replay_keys = &SetAssocTlb::replay_avx2<2>; break;
+            case 3: replay_keys = &SetAssocTlb::replay_avx2<3>; break;
+            case 4: replay_keys = &SetAssocTlb::replay_avx2<4>; break;
+            case 5: replay_keys = &SetAssocTlb::replay_avx2<5>; break;
+            case 6: replay_keys = &SetAssocTlb::replay_avx2<6>; break;
+            case 7: replay_keys = &SetAssocTlb::replay_avx2<7>; break;
+            default: replay_keys = &SetAssocTlb::replay_avx2<8>; break;
+            }
+        }
+    }
+
+    // Look up n keys in order, returns the misses
+    u64 replay(const u64 *keys, size_t n) {
+        return (this->*replay_keys)(keys, n);
+    }
+
+    u64 last_key = ~(u64) 0;  // Key of the latest lookup, on the most recent tag of its set
+
+private:
+    u64 *set_of(u64 key) {
+        return storage.data() + offset + ((key >> index_shift) & mask) * stride;
+    }
+
+    u64 replay_scalar(const u64 *keys, size_t n) {
+        u64 misses = 0;
+        for (size_t k = 0; k < n; k++) {
+            u64 key = keys[k];
+            u64 *set = set_of(key);
+            int i = 0;
+            while (i < ways && set[i] != key) i++;
+            misses += i == ways;
+            for (int j = min(i, ways - 1); j > 0; j--) {
+                set[j] = set[j - 1];
+            }
+            set[0] = key;
+        }
+        return misses;
+    }
+
+    template <int Chunks>
+    __attribute__((target("avx2")))
+    u64 replay_avx2(const u64 *keys, size_t n) {
+        const u64 valid = ((u64) 2 << (ways - 1)) - 1;
+        u64 misses = 0;
+        for (size_t k = 0; k < n; k++) {
+            u64 *set = set_of(keys[k]);
+            __m256i key = _mm256_set1_epi64x(keys[k]);
+            __m256i tags[Chunks];
+            u64 match = 0;
+            for (int c = 0; c < Chunks; c++) {
+                tags[c] = _mm256_load_si256((const __m256i *) (set + 4 * c));
+                match |= (u64) _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(tags[c], key))) << (4 * c);
+            }
+            match &= valid;
+            misses += match == 0;
+            // The hit, or the last way on a miss, goes to the front and the ways before it move back
+            __m256i hit_way = _mm256_set1_epi64x(__builtin_ctzll(match | (u64) 1 << (ways - 1)));
+            __m256i before = key;
+            for (int c = 0; c < Chunks; c++) {
+                __m256i shifted = _mm256_blend_epi32(_mm256_permute4x64_epi64(tags[c], 0x93),
+                                                     _mm256_permute4x64_epi64(before, 0xff), 0x03);
+                __m256i way = _mm256_setr_epi64x(4 * c, 4 * c + 1, 4 * c + 2, 4 * c + 3);
+                __m256i keep = _mm256_cmpgt_epi64(way, hit_way);
+                _mm256_store_si256((__m256i *) (set + 4 * c), _mm256_blendv_epi8(shifted, tags[c], keep));
+                before = tags[c];
+            }
+        }
+        return misses;
+    }
+
+    u64 mask;
+    int ways;
+    int stride;        // Tags per set, ways rounded up to whole vectors
+    int index_shift;
+    size_t offset;
+    vector<u64> storage;
+    u64 (SetAssocTlb::*replay_keys)(const u64 *, size_t);
+};
+
+// Simulated translation models, in the order of tlb_models
+enum SimKind { SIM_PAGES, SIM_COALESCE, SIM_RANGE };
+struct SimModel {
+    SimKind kind;
+    int max_order;  // SIM_PAGES: largest page order (0, 9 or 18)
+    int shift;      // SIM_COALESCE: log2 of the group size
+};
+
+static vector<SimModel> sim_models(const vector<int> &coalesce_ways) {
+    vector<SimModel> models = {{SIM_PAGES, 0, 0}, {SIM_PAGES, 9, 0}, {SIM_PAGES, 18, 0}};
+    for (int ways : coalesce_ways) {
+        models.push_back({SIM_COALESCE, 0, __builtin_ctz(ways)});
+    }
+    models.push_back({SIM_RANGE, 0, 0});
+    return models;
+}
+
+// =================================================================================================
+// Translation entry used by an access, as a key that also selects its set (see index_shift)
+//  - Pages: the largest page of the model no larger than huge_order, as tlb_models counts them.
+//    Keys carry the page order in their low bits, above them the page number selects the set.
+//  - Coalescing: the part of the run inside the aligned group of the access, identified by the
+//    first page of the run in the group, which is unique for any group size. The group selects
+//    the set.
+//  - Range: the run itself, in a fully associative TLB
+// =================================================================================================
+template <SimKind Kind>
+static inline u64 entry_of(const SimModel &model, const SimAccess &a) {
+    if (Kind == SIM_PAGES) {
+        int order = min(a.huge_order, model.max_order);
+        return (a.VPN >> order) << 2 | (order / 9);
+    }
+    else if (Kind == SIM_COALESCE) {
+        u64 group_start = a.VPN >> model.shift << model.shift;
+        return max(a.run_VPN, group_start);
+    }
+    return a.run_VPN;
+}
+
+static int index_shift(const SimModel &model) {
+    return model.kind == SIM_PAGES ? 2 : model.kind == SIM_COALESCE ? model.shift : 0;
+}
+
+// Replay a block of accesses on the TLB of model, keys is scratch for n keys
+//  - An entry repeating the one before hits the most recent tag of its set and changes nothing, so
+//    only the others are looked up
+template <SimKind Kind>
+static u64 replay(const SimModel &model, const SimAccess *accesses, size_t n, SetAssocTlb &tlb, u64 *keys) {
+    size_t n_keys = 0;
+    u64 last = tlb.last_key;
+    for (size_t i = 0; i < n; i++) {
+        u64 key = entry_of<Kind>(model, accesses[i]);
+        keys[n_keys] = key;
+        n_keys += key != last;
+        last = key;
+    }
+    tlb.last_key = last;
+    return tlb.replay(keys, n_keys);
+}
+
+// =================================================================================================
+// Simulate one shard of accesses on its own TLBs, one per model
+//  - next(block) fills block with up to SIM_BLOCK_ACCESSES accesses and returns how many, 0 at the
+//    end of the shard. Accesses outside every run are counted in untracked.
+// =================================================================================================
+template <typename Next>
+static void simulate_shard(const vector<SimModel> &models, const TlbGeometry &geometry, Next next,
+                           vector<TlbSimResult> &results, u64 &untracked) {
+    vector<SetAssocTlb> tlbs;
+    for (const auto &model : models) {
+        if (model.kind == SIM_RANGE) {
+            tlbs.emplace_back(1, geometry.range_entries, index_shift(model));
+        } else {
+            tlbs.emplace_back(geometry.sets, geometry.ways, index_shift(model));
+        }
+    }
+    vector<SimAccess> block(SIM_BLOCK_ACCESSES);
+    vector<u64> keys(SIM_BLOCK_ACCESSES);
+    size_t n;
+    while ((n = next(block.data())) > 0) {
+        size_t tracked = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (block[i].run_VPN != NO_RUN) block[tracked++] = block[i];
+        }
+        untracked += n - tracked;
+        for (size_t m = 0; m < models.size(); m++) {
+            u64 misses;
+            switch (models[m].kind) {
+            case SIM_PAGES:    misses = replay<SIM_PAGES>(models[m], block.data(), tracked, tlbs[m], keys.data()); break;
+            case SIM_COALESCE: misses = replay<SIM_COALESCE>(models[m], block.data(), tracked, tlbs[m], keys.data()); break;
+            default:           misses = replay<SIM_RANGE>(models[m], block.data(), tracked, tlbs[m], keys.data()); break;
+            }
+            results[m].accesses += tracked;
+            results[m].misses += misses;
+        }
+    }
+}
+
+// Run n_threads shards and sum their results, shard(t, results, untracked) simulates shard t
+template <typename Shard>
+static vector<TlbSimResult> simulate_shards(size_t n_models, int n_threads, u64 &untracked, Shard shard) {
+    vector<vector<TlbSimResult>> partial(n_threads, vector<TlbSimResult>(n_models));
+    vector<u64> partial_untracked(n_threads, 0);
+    run_workers(n_threads, [&](int t) { shard(t, partial[t], partial_untracked[t]); });
+    vector<TlbSimResult> results(n_models);
+    untracked = 0;
+    for (int t = 0; t < n_threads; t++) {
+        for (size_t m = 0; m < n_models; m++) {
+            results[m].accesses += partial[t][m].accesses;
+            results[m].misses += partial[t][m].misses;
+        }
+        untracked += partial_untracked[t];
+    }
+    return results;
+}
+
+// =================================================================================================
+// Run lookup by VPN, a static search tree over the run starts
+//  - Level 0 holds every run, as its start and end, each level above every RUN_INDEX_FANOUT-th start
+//    of the one below, up to a top level of at most RUN_INDEX_FANOUT^2 starts
+//  - A search bisects the top level, which stays in cache, then descends one slice of
+//    RUN_INDEX_FANOUT starts, a cache line or two, per level. Slices are bisected without branches,
+//    so a search costs about one cache miss per level and no mispredictions.
+//  - Ends sit next to the starts, so checking the run found, or the hint, is no further miss.
+//    Resolving an access never touches the (larger) run list.
+// =================================================================================================
+#define RUN_INDEX_FANOUT 8
+
+class RunIndex {
+public:
+    explicit RunIndex(const vector<SnapshotRun> &runs) {
+        vector<u64> starts;
+        for (const auto &run : runs) {
+            spans.push_back({run.VPN, run.VPN + run.length});
+            starts.push_back(run.VPN);
+            u64 offset = run.VPN - run.PFN;
+            aligned_order.push_back((offset & ((1 << 18) - 1)) == 0 ? 18 : (offset & ((1 << 9) - 1)) == 0 ? 9 : 0);
+        }
+        while (starts.size() > RUN_INDEX_FANOUT * RUN_INDEX_FANOUT) {
+            vector<u64> level;
+            for (size_t i = 0; i < starts.size(); i += RUN_INDEX_FANOUT) {
+                level.push_back(starts[i]);
+            }
+            levels.push_back(move(level));
+            starts = levels.back();
+        }
+    }
+
+    // Index of the run holding VPN, NO_RUN if none, trying hint first
+    inline size_t find(u64 VPN, size_t hint) const {
+        if (hint != NO_RUN && VPN - spans[hint].start < spans[hint].end - spans[hint].start) {
+            return hint;
+        }
+        if (spans.empty() || VPN < spans[0].start) {
+            return NO_RUN;
+        }
+        // Levels above 0, from the top
+        size_t i = 0, n = spans.size();
+        for (size_t l = levels.size(); l-- > 0;) {
+            size_t slice = i * RUN_INDEX_FANOUT;
+            size_t width = l + 1 == levels.size() ? levels[l].size() : min((size_t) RUN_INDEX_FANOUT, levels[l].size() - slice);
+            i = slice + last_at_most(levels[l].data() + slice, width, VPN);
+        }
+        size_t slice = levels.empty() ? 0 : i * RUN_INDEX_FANOUT;
+        size_t width = levels.empty() ? n : min((size_t) RUN_INDEX_FANOUT, n - slice);
+        i = slice + last_at_most(spans.data() + slice, width, VPN);
+        return VPN < spans[i].end ? i : NO_RUN;
+    }
+
+    // Access to VPN in run, run_VPN is NO_RUN when run is
+    inline SimAccess access(u64 VPN, size_t run) const {
+        if (run == NO_RUN) {
+            return {VPN, NO_RUN, 0};
+        }
+        const RunSpan &span = spans[run];
+        for (int order = aligned_order[run]; order > 0; order -= 9) {
+            u64 size = (u64) 1 << order;
+            u64 block = VPN & ~(size - 1);
+            if (block >= span.start && block + size <= span.end) {
+                return {VPN, span.start, order};
+            }
+        }
+        return {VPN, span.start, 0};
+    }
+
+private:
+    struct RunSpan {
+        u64 start;
+        u64 end;
+    };
+
+    static inline u64 start_of(u64 start) { return start; }
+    static inline u64 start_of(const RunSpan &span) { return span.start; }
+
+    // Position of the last of the n sorted values that starts at most at VPN, the first must
+    template <typename T>
+    static inline size_t last_at_most(const T *values, size_t n, u64 VPN) {
+        const T *base = values;
+        while (n > 1) {
+            size_t half = n / 2;
+            base = start_of(base[half]) <= VPN ? base + half : base;
+            n -= half;
+        }
+        return base - values;
+    }
+
+    vector<RunSpan> spans;           // Level 0
+    vector<vector<u64>> levels;      // Levels 1 and up
+    vector<uint8_t> aligned_order;   // 18, 9 or 0
+};
+
+// =================================================================================================
+// Replay a trace of virtual addresses, split into n_threads consecutive shards with their own TLBs
+//  - Consecutive accesses usually hit the run of the access before them, which is checked before
+//    searching the run list
+// =================================================================================================
+vector<TlbSimResult> simulate_trace(const vector<SnapshotRun> &runs, const uint64_t *addresses, size_t n,
+                                    const vector<int> &coalesce_ways, const TlbGeometry &geometry, int n_threads, u64 &untracked) {
+    vector<SimModel> models = sim_models(coalesce_ways);
+    RunIndex index(runs);
+    size_t page_shift = __builtin_ctzll(sysconf(_SC_PAGE_SIZE));
+    return simulate_shards(models.size(), n_threads, untracked, [&](int t, vector<TlbSimResult> &results, u64 &shard_untracked) {
+        size_t pos = n * t / n_threads;
+        size_t end = n * (t + 1) / n_threads;
+        size_t hint = NO_RUN;
+        simulate_shard(models, geometry, [&](SimAccess *block) {
+            size_t count = min((size_t) SIM_BLOCK_ACCESSES, end - pos);
+            for (size_t i = 0; i < count; i++) {
+                u64 VPN = addresses[pos + i] >> page_shift;
+                size_t run = index.find(VPN, hint);
+                hint = run != NO_RUN ? run : hint;
+                block[i] = index.access(VPN, run);
+            }
+            pos += count;
+            return count;
+        }, results, shard_untracked);
+    });
+}
+
+// splitmix64, a fast generator good enough to draw accesses
+static inline u64 next_random(u64 &state) {
+    u64 z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// =================================================================================================
+// Replay n_accesses drawn from a page access histogram, (VPN, count) pairs
+//  - Pages are drawn independently with probability proportional to their count, with an alias
+//    table: one random number picks a slot and a threshold, so a draw is O(1) for any histogram
+//  - The run of every page is found once, up front, accesses are drawn as ready SimAccess
+//  - Each of the n_threads shards draws its share of the accesses from its own seed
+// =================================================================================================
+vector<TlbSimResult> simulate_histogram(const vector<SnapshotRun> &runs, const vector<pair<u64, u64>> &histogram, u64 n_accesses,
+                                        u64 seed, const vector<int> &coalesce_ways, const TlbGeometry &geometry, int n_threads,
+                                        u64 &untracked) {
+    vector<SimModel> models = sim_models(coalesce_ways);
+    size_t n = histogram.size();
+    vector<SimAccess> pages(n);
+    RunIndex index(runs);
+    double total = 0;
+    size_t hint = NO_RUN;
+    for (size_t i = 0; i < n; i++) {
+        size_t run = index.find(histogram[i].first, hint);
+        hint = run != NO_RUN ? run : hint;
+        pages[i] = index.access(histogram[i].first, run);
+        total += histogram[i].second;
+    }
+
+    // Vose's alias method, thresholds scaled to 32 bits
+    vector<uint32_t> threshold(n, UINT32_MAX);
+    vector<uint32_t> alias(n);
+    vector<double> scaled(n);
+    vector<size_t> small, large;
+    for (size_t i = 0; i < n; i++) {
+        alias[i] = i;
+        scaled[i] = (double) histogram[i].second * n / total;
+        (scaled[i] < 1 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        size_t s = small.back(), l = large.back();
+        small.pop_back();
+        threshold[s] = (uint32_t) (scaled[s] * UINT32_MAX);
+        alias[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    return simulate_shards(models.size(), n_threads, untracked, [&](int t, vector<TlbSimResult> &results, u64 &shard_untracked) {
+        u64 left = n_accesses * (t + 1) / n_threads - n_accesses * t / n_threads;
+        u64 state = seed + t;
+        simulate_shard(models, geometry, [&](SimAccess *block) {
+            size_t count = min((u64) SIM_BLOCK_ACCESSES, left);
+            for (size_t i = 0; i < count; i++) {
+                u64 r = next_random(state);
+                size_t slot = (size_t) (((r >> 32) * n) >> 32);
+                block[i] = pages[(uint32_t) r <= threshold[slot] ? slot : alias[slot]];
+            }
+            left -= count;
+            return count;
+        }, results, shard_untracked);
+    });
+}
+
+// =================================================================================================
+// Page access histogram, "<address> <count>" per line
+//  - Addresses are hex virtual addresses, with or without 0x, the page holding them is counted.
+//    Fields may be separated by spaces or commas, lines that do not parse (headers) are skipped.
+//  - Counts of the same page are summed, pages are returned in VPN order
+// =================================================================================================
+bool load_access_histogram(const string &path, vector<pair<u64, u64>> &histogram) {
+    ifstream in(path);
+    if (!in.is_open()) {
+        cerr << "Failed to open file " << path << endl;
+        return false;
+    }
+    size_t page_shift = __builtin_ctzll(sysconf(_SC_PAGE_SIZE));
+    string line;
+    while (getline(in, line)) {
+        replace(line.begin(), line.end(), ',', ' ');
+        istringstream fields(line);
+        string address;
+        u64 count;
+        char *end;
+        if (!(fields >> address >> count)) {
+            continue;
+        }
+        u64 vaddr = strtoull(address.c_str(), &end, 16);
+        if (*end != '\0') {
+            continue;
+        }
+        histogram.push_back({vaddr >> page_shift, count});
+    }
+    sort(histogram.begin(), histogram.end());
+    size_t out = 0;
+    for (size_t i = 0; i < histogram.size(); i++) {
+        if (out > 0 && histogram[out - 1].first == histogram[i].first) {
+            histogram[out - 1].second += histogram[i].second;
+        } else if (histogram[i].second > 0) {
+            histogram[out++] = histogram[i];
+        }
+    }
+    histogram.resize(out);
+    if (histogram.empty()) {
+        cerr << "No accesses in " << path << endl;
+        return false;
+    }
+    return true;
+}
@@ -6,9 +6,46 @@
 #include <algorithm>
 #include <numeric>
 #include <cassert>
+#include <string_view>
 
 #include "pmap.h"
 
+// Apply the region filter rules and track the region if it passes
+//  - skip_shared_mem carries the Pin shared memory state from one mapping to the next
+static void filterRegion(std::vector<MemoryRegion> &regions, size_t &totalRSS, bool filter, bool &skip_shared_mem,
+        MemoryRegion region, std::string_view permissions, std::string_view mapping) {
+    // Filter checks
+    if (filter) {
+        // Skip the shared memory regions
+        if (skip_shared_mem) {
+            skip_shared_mem = false;
+            return;
+        }
+
+        // Check for shared memory label
+        if (mapping.find("shared_mem") != std::string_view::npos) {
+            skip_shared_mem = true;
+            return;
+        }
+
+        // Skip memory not marked as RW, or containing certain strings in the mapping
+        if (permissions.compare("rw---") != 0 ||
+                mapping.find("pitracer") != std::string_view::npos ||
+                mapping.find("pin") != std::string_view::npos) {
+            return;
+        }
+    }
+
+    totalRSS += region.rss;
+
+    // Track RW regions about certain RSS only (10MB)
+    if (region.rss < (10 << 20) && filter) {
+        return;
+    }
+    region.perms = permissions;
+    regions.push_back(region);
+}
+
 void parsePmapOutput(std::vector<MemoryRegion> &regions, size_t &totalRSS, bool filter) {
     std::string line;
     totalRSS = 0;
@@ -19,6 +56,7 @@ void parsePmapOutput(std::vector<MemoryRegion> &regions, size_t &totalRSS, bool
 
     // Skip the first header line
     std::getline(std::cin, line);
+    size_t index = 0;
     while (std::getline(std::cin, line)) {
         std::istringstream iss(line);
         uint64_t address;
@@ -31,40 +69,147 @@ void parsePmapOutput(std::vector<MemoryRegion> &regions, size_t &totalRSS, bool
             continue; 
         }
 
-        // Filter checks
-        if (filter) {
-            // Skip the shared memory regions
-            if (skip_shared_mem) {
-                skip_shared_mem = false;
-                continue;
-            }
+        // Size and RSS are in KB, convert to bytes
+        MemoryRegion region(address, size << 10, rss << 10);
+        region.index = index++;
+        region.name = mapping == "[" ? "[anon]" : mapping;
+        filterRegion(regions, totalRSS, filter, skip_shared_mem, region, permissions, mapping);
+    }
+}
 
-            // Check for shared memory label
-            if (mapping.find("shared_mem") != std::string::npos) {
-                skip_shared_mem = true;
-                continue;
-            }
+// Parse a hex or decimal number at the start of s, advancing s past it
+static uint64_t parseNumber(std::string_view &s, int base) {
+    uint64_t value = 0;
+    size_t i = 0;
+    for (; i < s.size(); i++) {
+        char c = s[i];
+        int digit;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (base == 16 && c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else break;
+        value = value * base + digit;
+    }
+    s.remove_prefix(i);
+    return value;
+}
 
-            // Skip memory not marked as RW, or containing certain strings in the mapping
-            if (permissions.compare("rw---") != 0 ||
-                    mapping.find("pitracer") != std::string::npos ||
-                    mapping.find("pin") != std::string::npos) {
-                continue;
-            }
+// Split off the next space-separated field of s
+static std::string_view nextField(std::string_view &s) {
+    size_t start = s.find_first_not_of(' ');
+    if (start == std::string_view::npos) {
+        s = std::string_view();
+        return s;
+    }
+    s.remove_prefix(start);
+    size_t end = std::min(s.find(' '), s.size());
+    std::string_view field = s.substr(0, end);
+    s.remove_prefix(end);
+    return field;
+}
+
+// Read /proc/<pid>/smaps and parse it in place, applying the same rules as parsePmapOutput
+//  - Permissions are converted to the pmap -x mode ("rw-p" -> "rw---") and mappings to the name
+//    pmap prints (basename of the path), so the filter rules match the pmap path exactly
+//  - AnonHugePages, THPeligible and KernelPageSize are kept per region
+//  - hugetlb pages are not part of Rss in smaps, they are added to the region RSS so hugetlb
+//    mappings are tracked like any other
+bool parseSmaps(pid_t pid, std::vector<MemoryRegion> &regions, size_t &totalRSS, bool filter) {
+    char smaps_file[BUFSIZ];
+    snprintf(smaps_file, sizeof(smaps_file), "/proc/%ju/smaps", (uintmax_t)pid);
+    int fd = open(smaps_file, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    // smaps is generated on read, its size is unknown up front
+    std::string buf;
+    size_t len = 0;
+    for (;;) {
+        if (buf.size() - len < (1 << 16)) {
+            buf.resize(std::max(buf.size() * 2, (size_t) 1 << 20));
         }
-        
+        ssize_t ret = read(fd, &buf[len], buf.size() - len);
+        if (ret < 0) {
+            close(fd);
+            return false;
+        }
+        if (ret == 0) break;
+        len += ret;
+    }
+    close(fd);
 
-        // Size and RSS are in KB, convert to bytes
-        size <<= 10;
-        rss <<= 10;
-        totalRSS += rss;
+    totalRSS = 0;
+    bool skip_shared_mem = false;
+    bool have_region = false;
+    size_t index = 0;
+    MemoryRegion region(0, 0, 0);
+    char permissions[6] = "-----";
+    std::string_view mapping;
+    auto finishRegion = [&]() {
+        if (have_region) {
+            filterRegion(regions, totalRSS, filter, skip_shared_mem, region, permissions, mapping);
+        }
+    };
+
+    std::string_view data(buf.data(), len);
+    while (!data.empty()) {
+        size_t eol = std::min(data.find('\n'), data.size());
+        std::string_view line = data.substr(0, eol);
+        data.remove_prefix(std::min(eol + 1, data.size()));
+        if (line.empty()) continue;
 
-        // Track RW regions about certain RSS only (10MB)
-        if (rss < (10 << 20) && filter) {
+        // Field lines start with a capitalized key, mapping headers with a lowercase hex address
+        if (line[0] >= 'A' && line[0] <= 'Z') {
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos || !have_region) continue;
+            std::string_view key = line.substr(0, colon);
+            std::string_view value = line.substr(colon + 1);
+            value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+            if (key == "Rss") {
+                region.rss = parseNumber(value, 10) << 10;
+            } else if (key == "AnonHugePages") {
+                region.anon_huge = parseNumber(value, 10) << 10;
+            } else if (key == "THPeligible") {
+                region.thp_eligible = parseNumber(value, 10) != 0;
+            } else if (key == "KernelPageSize") {
+                region.kernel_page_size = parseNumber(value, 10) << 10;
+            } else if (key == "Shared_Hugetlb" || key == "Private_Hugetlb") {
+                region.rss += parseNumber(value, 10) << 10;
+            }
             continue;
         }
-        regions.emplace_back(address, size, rss);
+
+        // New mapping: "start-end perms offset dev inode [pathname]"
+        finishRegion();
+        uint64_t start = parseNumber(line, 16);
+        line.remove_prefix(1);
+        uint64_t end = parseNumber(line, 16);
+        std::string_view perms = nextField(line);
+        nextField(line);
+        nextField(line);
+        nextField(line);
+        line.remove_prefix(std::min(line.find_first_not_of(' '), line.size()));
+
+        region = MemoryRegion(start, end - start, 0);
+        region.index = index++;
+        region.name = line.empty() ? "[anon]" : std::string(line);
+        have_region = true;
+        for (int i = 0; i < 3 && i < (int) perms.size(); i++) {
+            permissions[i] = perms[i];
+        }
+        permissions[3] = (perms.size() > 3 && perms[3] == 's') ? 's' : '-';
+
+        // pmap prints the basename of file mappings up to the first space, and "[ anon ]" otherwise
+        if (line.empty() || line[0] == '[') {
+            mapping = "[";
+        } else {
+            size_t slash = line.rfind('/');
+            if (slash != std::string_view::npos) line.remove_prefix(slash + 1);
+            mapping = nextField(line);
+        }
     }
+    finishRegion();
+    return true;
 }
 
 std::vector<MemoryRegion> findLargestRegions(const std::vector<MemoryRegion> &regions, size_t totalRSS, float coverage, u64 max_regions) {
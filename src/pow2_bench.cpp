@@ -0,0 +1,137 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include "pagemap_dump/pmap.h"
+
+using namespace std;
+
+// =================================================================================================
+// Reference recursive implementations, as count_pow2 and count_pow2_aligned were before they were
+// made iterative. Used to check the histograms match and to compare speed.
+// =================================================================================================
+static void count_pow2_recursive(u64 start, u64 end, int pow_largest, u64* region_count) {
+    u64 region_size = end - start;
+    if (pow_largest < CONT_LOWEST || region_size == 0) return;
+    if (region_size < ((u64) 1 << pow_largest)) {
+        count_pow2_recursive(start, end, pow_largest - 1, region_count);
+        return;
+    }
+    u64 end_aligned = end >> pow_largest;
+    u64 start_truncated = start >> pow_largest;
+    u64 start_aligned = start_truncated + (start % ((u64) 1 << pow_largest) == 0 ? 0 : 1);
+    if (start_aligned == end_aligned) {
+        count_pow2_recursive(start, end, pow_largest - 1, region_count);
+        return;
+    }
+    region_count[pow_largest - CONT_LOWEST] += end_aligned - start_aligned;
+    count_pow2_recursive(start, start_aligned << pow_largest, pow_largest - 1, region_count);
+    count_pow2_recursive(end_aligned << pow_largest, end, pow_largest - 1, region_count);
+}
+
+static void count_pow2_aligned_recursive(u64 start, u64 end, u64 v_start, int pow_largest, u64* region_count) {
+    u64 region_size = end - start;
+    if (pow_largest < CONT_LOWEST || region_size == 0) return;
+    u64 pow_mask = ((u64) 1 << pow_largest) - 1;
+    if (region_size < ((u64) 1 << pow_largest) || (start & pow_mask) != (v_start & pow_mask)) {
+        count_pow2_aligned_recursive(start, end, v_start, pow_largest - 1, region_count);
+        return;
+    }
+    u64 end_aligned = end >> pow_largest;
+    u64 start_truncated = start >> pow_largest;
+    u64 start_aligned = start_truncated + (start % ((u64) 1 << pow_largest) == 0 ? 0 : 1);
+    if (start_aligned == end_aligned) {
+        count_pow2_aligned_recursive(start, end, v_start, pow_largest - 1, region_count);
+        return;
+    }
+    region_count[pow_largest - CONT_LOWEST] += end_aligned - start_aligned;
+    count_pow2_aligned_recursive(start, start_aligned << pow_largest, v_start, pow_largest - 1, region_count);
+    v_start += (end_aligned << pow_largest) - start;
+    count_pow2_aligned_recursive(end_aligned << pow_largest, end, v_start, pow_largest - 1, region_count);
+}
+
+struct Run {
+    u64 start;
+    u64 end;
+    u64 v_start;
+};
+
+// Random runs shaped like a fragmented heap: mostly short runs, some THP-sized, a few very large
+static vector<Run> random_runs(size_t n, mt19937_64 &rng) {
+    vector<Run> runs(n);
+    uniform_int_distribution<u64> pfn(0, (u64) 1 << 36);
+    uniform_int_distribution<int> kind(0, 99);
+    for (auto &run : runs) {
+        u64 length;
+        int k = kind(rng);
+        if (k < 80) length = 1 + rng() % 16;
+        else if (k < 95) length = 1 + rng() % 2048;
+        else length = 1 + rng() % ((u64) 1 << 22);
+        run.start = pfn(rng);
+        if (k % 2) run.start &= ~(u64) 511;
+        run.end = run.start + length;
+        run.v_start = (k % 3) ? pfn(rng) : run.start + ((u64) 512 << (rng() % 8));
+    }
+    return runs;
+}
+
+template <typename F>
+static double time_runs(const vector<Run> &runs, u64 *counts, F fn) {
+    auto t0 = chrono::steady_clock::now();
+    for (const auto &run : runs) {
+        fn(run, counts);
+    }
+    return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+// Compare the iterative count_pow2 and the templated run counters against the recursive version
+//  - Checks all give identical histograms, unaligned and aligned
+//  - Prints millions of runs per second for each
+int main(int argc, char** argv) {
+    size_t n_runs = argc > 1 ? stoull(argv[1]) : 10000000;
+    mt19937_64 rng(42);
+    vector<Run> runs = random_runs(n_runs, rng);
+    const int n_orders = CONT_HIGHEST - CONT_LOWEST + 1;
+
+    // Run list layout used by the scanner, for the templated run counters
+    vector<u64> starts_P(n_runs), starts_V(n_runs), lengths(n_runs);
+    for (size_t i = 0; i < n_runs; i++) {
+        starts_P[i] = runs[i].start;
+        starts_V[i] = runs[i].v_start;
+        lengths[i] = runs[i].end - runs[i].start;
+    }
+
+    bool ok = true;
+    cout << fixed << setprecision(1);
+    for (int aligned = 0; aligned <= 1; aligned++) {
+        u64 old_counts[n_orders] = {0};
+        u64 new_counts[n_orders] = {0};
+        u64 batch_counts[CONT_MAX_ORDER - CONT_LOWEST + 1] = {0};
+        double t_old, t_new;
+        if (aligned) {
+            t_old = time_runs(runs, old_counts, [](const Run &r, u64 *c) { count_pow2_aligned_recursive(r.start, r.end, r.v_start, CONT_HIGHEST, c); });
+            t_new = time_runs(runs, new_counts, [](const Run &r, u64 *c) { count_pow2_aligned(r.start, r.end, r.v_start, CONT_HIGHEST, c); });
+        } else {
+            t_old = time_runs(runs, old_counts, [](const Run &r, u64 *c) { count_pow2_recursive(r.start, r.end, CONT_HIGHEST, c); });
+            t_new = time_runs(runs, new_counts, [](const Run &r, u64 *c) { count_pow2(r.start, r.end, CONT_HIGHEST, c); });
+        }
+        pow2_counter counter = get_pow2_counter(aligned, CONT_HIGHEST);
+        auto t0 = chrono::steady_clock::now();
+        counter(starts_P.data(), starts_V.data(), lengths.data(), n_runs, batch_counts);
+        double t_batch = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+        bool match = memcmp(old_counts, new_counts, sizeof(old_counts)) == 0 &&
+                     memcmp(old_counts, batch_counts, sizeof(old_counts)) == 0;
+        ok &= match;
+
+        cout << (aligned ? "aligned:   " : "unaligned: ")
+             << "recursive " << n_runs / t_old / 1e6 << " M runs/s, "
+             << "iterative " << n_runs / t_new / 1e6 << " M runs/s, "
+             << "templated " << n_runs / t_batch / 1e6 << " M runs/s, "
+             << "speedup " << t_old / t_batch << "x, "
+             << (match ? "histograms match" : "HISTOGRAMS DIFFER") << endl;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -6,11 +6,13 @@ import pandas as pd
 import numpy as np
 import sys
 import os
+import re
 
 # Check whether page table mappings change over time
 def check_page_table_mappings(dir):
     # Get all files in the directory and iterate in time order
-    files = [f for f in os.listdir(dir) if f.startswith("pagemap_")]
+    # Sidecars dump_pagemap writes next to a snapshot (.vmas, .numa, ...) are skipped
+    files = [f for f in os.listdir(dir) if re.fullmatch(r"pagemap_\d+(\.txt|\.csv)?", f)]
     files.sort(key=lambda x: int(x.split('_')[1].split('.')[0]))
 
     # Store mappings of each virtual page
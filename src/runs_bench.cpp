@@ -0,0 +1,97 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include "pagemap_dump/pmap.h"
+
+using namespace std;
+
+// Pagemap entry of a present page
+static inline uint64_t present(u64 pfn) {
+    return ((uint64_t) 1 << 63) | pfn;
+}
+
+// Entries of n pages
+//  - contiguous: a single run
+//  - fragmented: every page in its own run, one in 8 absent
+//  - mixed: runs of 1 to 1024 pages, mostly short, with absent gaps
+static vector<uint64_t> make_entries(const string &kind, size_t n, mt19937_64 &rng) {
+    vector<uint64_t> entries(n);
+    uniform_int_distribution<u64> pfn(1, (u64) 1 << 36);
+    if (kind == "contiguous") {
+        u64 start = pfn(rng);
+        for (size_t i = 0; i < n; i++) entries[i] = present(start + i);
+    }
+    else if (kind == "fragmented") {
+        for (size_t i = 0; i < n; i++) entries[i] = rng() % 8 ? present(pfn(rng)) : 0;
+    }
+    else {
+        for (size_t i = 0; i < n;) {
+            size_t length = rng() % 4 ? 1 + rng() % 16 : 1 + rng() % 1024;
+            bool absent = rng() % 10 == 0;
+            u64 start = pfn(rng);
+            for (size_t j = 0; j < length && i < n; j++, i++) {
+                entries[i] = absent ? 0 : present(start + j);
+            }
+        }
+    }
+    return entries;
+}
+
+// Fastest of reps passes over entries, in seconds
+template <typename F>
+static double time_finder(const vector<uint64_t> &entries, vector<PagemapRun> &runs, size_t &n_runs, int reps, F finder) {
+    double best = 0;
+    for (int r = 0; r < reps; r++) {
+        auto t0 = chrono::steady_clock::now();
+        for (size_t offset = 0; offset < entries.size(); offset += PAGEMAP_CHUNK_PAGES) {
+            size_t count = min((size_t) PAGEMAP_CHUNK_PAGES, entries.size() - offset);
+            n_runs = finder(entries.data() + offset, count, runs.data());
+        }
+        double t = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        best = r == 0 ? t : min(best, t);
+    }
+    return best;
+}
+
+static bool same_runs(const vector<PagemapRun> &a, const vector<PagemapRun> &b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (a[i].offset != b[i].offset || a[i].length != b[i].length || a[i].PFN != b[i].PFN) return false;
+    }
+    return true;
+}
+
+// Compare the run finders on buffers of PAGEMAP_CHUNK_PAGES entries, as the scanner reads them
+//  - Checks the AVX2 kernel finds the same runs as the scalar loop
+//  - Prints millions of pages per second for each input shape, the best of reps passes
+int main(int argc, char** argv) {
+    size_t n_pages = argc > 1 ? stoull(argv[1]) : 1 << 24;
+    int reps = argc > 2 ? stoi(argv[2]) : 5;
+    mt19937_64 rng(42);
+    bool avx2 = __builtin_cpu_supports("avx2");
+
+    bool ok = true;
+    cout << fixed << setprecision(1);
+    for (const string kind : {"contiguous", "fragmented", "mixed"}) {
+        vector<uint64_t> entries = make_entries(kind, n_pages, rng);
+        vector<PagemapRun> scalar(PAGEMAP_CHUNK_PAGES + 1), vec(PAGEMAP_CHUNK_PAGES + 1);
+        size_t n_scalar = 0, n_vec = 0;
+        double t_scalar = time_finder(entries, scalar, n_scalar, reps, find_runs_scalar);
+        cout << setw(11) << left << kind << right
+             << " scalar " << n_pages / t_scalar / 1e6 << " M pages/s, ";
+        if (avx2) {
+            double t_vec = time_finder(entries, vec, n_vec, reps, find_runs_avx2);
+            bool match = n_scalar == n_vec && same_runs(scalar, vec, n_scalar);
+            cout << "avx2 " << n_pages / t_vec / 1e6 << " M pages/s, "
+                 << "speedup " << t_scalar / t_vec << "x, " << (match ? "runs match" : "RUNS DIFFER");
+            ok &= match;
+        }
+        else {
+            cout << "avx2 not supported";
+        }
+        cout << endl;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
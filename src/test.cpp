@@ -1,16 +1,52 @@
 #include <iostream>
-#include "pmap.h"
+#include <vector>
+#include "pagemap_dump/pmap.h"
 
 using namespace std;
 
+// Per-page orders the sampling estimator sees (pow2_window, then pow2_order_at on the clipped run),
+// summed over every page of a run, must match count_pow2 on the whole run
+//  - Runs start near VPN 0, where the window of a probe reaches below the mapping
+static int check_window_orders(bool aligned, int pow_largest) {
+    int failures = 0;
+    for (u64 v_start = 0; v_start < 40; v_start += 3) {
+        for (u64 start : {(u64) 0, (u64) 5, (u64) 1000, (u64) 4093, (u64) 8192 + 17}) {
+            for (u64 length : {(u64) 1, (u64) 7, (u64) 300, (u64) 5000}) {
+                u64 expected[CONT_MAX_ORDER + 1] = {0};
+                if (aligned) count_pow2_aligned(start, start + length, v_start, pow_largest, expected);
+                else count_pow2(start, start + length, pow_largest, expected);
+
+                u64 seen[CONT_MAX_ORDER + 1] = {0};
+                for (u64 VPN = v_start; VPN < v_start + length; VPN++) {
+                    u64 pfn = start + VPN - v_start;
+                    u64 lo = v_start, hi = v_start + length;
+                    pow2_window(VPN, pfn, pow_largest, lo, hi);
+                    int order = pow2_order_at(start + lo - v_start, start + hi - v_start, lo, pfn, aligned, pow_largest);
+                    if (order >= 0) seen[order - CONT_LOWEST]++;
+                }
+                for (int i = 0; i <= CONT_MAX_ORDER - CONT_LOWEST; i++) {
+                    if (seen[i] != expected[i] << (i + CONT_LOWEST)) {
+                        cout << "Mismatch: aligned " << aligned << " max order " << pow_largest << " run " << v_start << "->"
+                             << start << "+" << length << " order " << i + CONT_LOWEST << ": " << seen[i] << " pages, expected "
+                             << (expected[i] << (i + CONT_LOWEST)) << endl;
+                        failures++;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return failures;
+}
+
 int main(int argc, char** argv) {
-    u64 pow2_regions[15] = {0};
+    u64 pow2_regions[CONT_HIGHEST - CONT_LOWEST + 1] = {0};
     u64 start = 0b0000000000000010010000000000000;
     u64 end   = 0b0000000000010000000000000000000;
     count_pow2(start, end, 18, pow2_regions);
 
-    for (int i = 0; i < 15; i++) {
-        u64 kb_page = 1 << (i + 6);
+    for (int i = 0; i <= CONT_HIGHEST - CONT_LOWEST; i++) {
+        u64 kb_page = (u64) 4 << (i + CONT_LOWEST);
         if (kb_page >= 1024) {
             kb_page >>= 10;
             if (kb_page >= 1024) cout << (kb_page >> 10) << "GB:\t";
@@ -21,5 +57,11 @@ int main(int argc, char** argv) {
 
         cout << hex << pow2_regions[i] << dec << endl;
     }
-    return 0;
-}
\ No newline at end of file
+
+    int failures = 0;
+    for (int pow_largest : {2, 9, 12, 18}) {
+        failures += check_window_orders(false, pow_largest) + check_window_orders(true, pow_largest);
+    }
+    cout << "Window order check: " << (failures ? "FAILED" : "OK") << endl;
+    return failures ? 1 : 0;
+}